@@ -0,0 +1,211 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "qoi.h"
+
+/**
+ * Measures how close qoi_estimate_encoded_size() comes to the size of the file
+ * that qoi_save() writes, over classes of image at common screen sizes. Each
+ * image is saved, and its estimate is compared with the size of the file.
+ * Prints one line per image, and exits with 1 if the size of any image falls
+ * outside the bound given with its estimate.
+ */
+
+/**
+ * The classes of test image. Flat fills and tiles stress runs and the
+ * 'previous colors' array, which screenshots and user interfaces lean on.
+ */
+typedef enum
+{
+	SOLID,
+	TILES,
+	INTERFACE,
+	GRADIENT,
+	PHOTO,
+	NOISE,
+	SPRITES,
+	CONTENT_COUNT
+} Content;
+
+static const char *content_names[] = {
+	"solid", "tiles", "interface", "gradient", "photo", "noise", "sprites"
+};
+
+/**
+ * The dimensions of the test images.
+ */
+static const uint32_t sizes[][2] = { { 1000, 700 }, { 1920, 1080 }, { 3840, 2160 } };
+
+/**
+ * Returns the next value of the linear congruential generator at STATE, so
+ * that the test images are the same on every platform.
+ */
+static uint32_t next_random(
+		uint32_t *state)
+{
+	*state = *state * 1664525 + 1013904223;
+	return *state >> 8;
+}
+
+/**
+ * Returns a pseudo-random color component for the cell at X and Y, mixed with
+ * SEED, so that a cell always has the same color.
+ */
+static uint8_t cell_color(
+		uint32_t x,
+		uint32_t y,
+		uint32_t seed)
+{
+	uint32_t hash = (x * 73856093) ^ (y * 19349663) ^ (seed * 83492791);
+	hash ^= hash >> 13;
+	hash *= 0x5BD1E995;
+	return hash >> 24;
+}
+
+/**
+ * Fills the raster of IMAGE with the test content KIND.
+ */
+static void fill(
+		Qoi *image,
+		Content kind)
+{
+	uint32_t width = qoi_get_width(image);
+	uint32_t height = qoi_get_height(image);
+	int channels = qoi_get_channels(image);
+	uint8_t *raster = qoi_get_raster(image);
+	uint32_t state = kind + 1;
+
+	for (uint32_t y = 0; y < height; y++) {
+		for (uint32_t x = 0; x < width; x++) {
+			uint8_t *pixel = raster + ((size_t) y * width + x) * channels;
+			uint8_t value[4] = { 0, 0, 0, 255 };
+			uint32_t noise = next_random(&state);
+
+			switch (kind) {
+			case SOLID:
+				value[0] = 40;
+				value[1] = 80;
+				value[2] = 120;
+				break;
+			case TILES:
+				for (int c = 0; c < 3; c++) {
+					value[c] = cell_color(x / 200, y / 100, c);
+				}
+				break;
+			case INTERFACE:
+				/* Panels of flat color, with title bars and rows of text. */
+				for (int c = 0; c < 3; c++) {
+					value[c] = 200 + cell_color(x / 320, y / 240, c) / 8;
+				}
+				if (y % 240 < 24) {
+					value[0] = value[1] = 60 + (y % 240) * 2;
+				} else if (y % 20 < 9 && x % 320 > 16 && x % 320 < 280 && noise % 3 == 0) {
+					value[0] = value[1] = value[2] = 30 + noise % 40;
+				}
+				break;
+			case GRADIENT:
+				value[0] = x;
+				value[1] = y;
+				value[2] = x ^ y;
+				break;
+			case PHOTO:
+				value[0] = (x / 3 + y / 5) + noise % 5;
+				value[1] = (x / 4 + 128) + noise % 3;
+				value[2] = (y / 2) + noise % 7;
+				break;
+			case NOISE:
+				value[0] = noise;
+				value[1] = noise >> 8;
+				value[2] = noise >> 16;
+				break;
+			default:
+				/* Sprites with hard edges over a transparent background. */
+				if ((x / 64 + y / 64) % 3 == 0) {
+					value[0] = x;
+					value[1] = y;
+					value[2] = 90;
+				} else {
+					value[3] = 0;
+				}
+				break;
+			}
+
+			for (int c = 0; c < channels; c++) {
+				pixel[c] = value[c];
+			}
+		}
+	}
+}
+
+/**
+ * Estimates and saves one test image, and prints the result. Returns 1 if the
+ * size of the file falls outside the bound given with the estimate, and 0 if
+ * it falls inside.
+ */
+static int measure(
+		const char *filepath,
+		Content kind,
+		uint32_t width,
+		uint32_t height,
+		QoiChannel channels)
+{
+	Qoi *image = qoi_new(width, height, QOI_COLORSPACE_SRGB, channels);
+	if (image == NULL) {
+		printf("%-9s %4ux%-4u %d: %s\n", content_names[kind], width, height, channels,
+		       qoi_strerror(qoi_errno()));
+		return 1;
+	}
+
+	fill(image, kind);
+	uint64_t bound;
+	uint64_t estimate = qoi_estimate_encoded_size(image, &bound);
+
+	struct stat file;
+	if (qoi_save(image, filepath) != 0 || stat(filepath, &file) != 0) {
+		printf("%-9s %4ux%-4u %d: %s\n", content_names[kind], width, height, channels,
+		       qoi_strerror(qoi_errno()));
+		qoi_free(image);
+		return 1;
+	}
+	qoi_free(image);
+
+	uint64_t actual = file.st_size;
+	uint64_t miss = estimate > actual ? estimate - actual : actual - estimate;
+	printf("%-9s %4ux%-4u %d  estimate %9llu +- %-8llu actual %9llu  error %+6.2f%%  %s\n",
+	       content_names[kind],
+	       width,
+	       height,
+	       channels,
+	       (unsigned long long) estimate,
+	       (unsigned long long) bound,
+	       (unsigned long long) actual,
+	       100.0 * ((double) estimate - (double) actual) / actual,
+	       miss <= bound ? "within" : "OUTSIDE");
+
+	return miss > bound;
+}
+
+int main()
+{
+	char filepath[] = "/tmp/qoi_accuracy_XXXXXX";
+	int fd = mkstemp(filepath);
+	if (fd == -1) {
+		perror("mkstemp");
+		return 1;
+	}
+	close(fd);
+
+	int outside = 0, count = 0;
+	for (int kind = 0; kind < CONTENT_COUNT; kind++) {
+		for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+			QoiChannel channels = kind == SPRITES ? QOI_CHANNEL_RGBA : QOI_CHANNEL_RGB;
+			outside += measure(filepath, kind, sizes[i][0], sizes[i][1], channels);
+			count++;
+		}
+	}
+
+	unlink(filepath);
+	printf("%d of %d images within the bound\n", count - outside, count);
+	return outside != 0;
+}
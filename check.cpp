@@ -0,0 +1,270 @@
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iterator>
+#include <vector>
+#include <unistd.h>
+#include "qoi.hpp"
+
+/**
+ * Checks that the encoder and decoder in qoi.hpp agree with the ones in
+ * libqoi. Each test image is saved with qoi_save() and encoded with
+ * qoi::encode(), and the two files must be the same byte for byte. The file
+ * must then decode back to the same pixels through qoi::decode(), in every
+ * layout. Exits with 1 and names the image if any check fails.
+ */
+
+namespace
+{
+
+/**
+ * The kinds of test image, each of which exercises a different set of QOI
+ * operations.
+ */
+enum Content
+{
+	NOISE,
+	GRADIENT,
+	FLAT,
+	PALETTE,
+	ALPHA,
+	CONTENT_COUNT
+};
+
+const char *content_names[] = { "noise", "gradient", "flat", "palette", "alpha" };
+
+/**
+ * The dimensions of the test images. The larger ones span several encoder
+ * blocks, so that runs crossing a block boundary are covered.
+ */
+const std::uint32_t sizes[][2] = { { 1, 1 }, { 17, 3 }, { 300, 200 }, { 1024, 129 } };
+
+/**
+ * Returns the next value of the linear congruential generator at STATE, so
+ * that the test images are the same on every platform.
+ */
+std::uint8_t next_random(std::uint32_t &state)
+{
+	state = state * 1664525 + 1013904223;
+	return state >> 24;
+}
+
+/**
+ * Fills the raster of IMAGE with the test content KIND.
+ */
+void fill(qoi::Image &image, Content kind)
+{
+	std::uint32_t width = image.width();
+	std::uint8_t channels = image.channels();
+	std::span<std::uint8_t> raster = image.raster();
+	std::uint32_t state = kind + 1;
+
+	for (std::size_t i = 0; i < raster.size() / channels; i++) {
+		std::uint8_t *pixel = raster.data() + i * channels;
+		std::uint32_t x = i % width;
+		std::uint32_t y = i / width;
+		std::uint8_t value[4] = { 0, 0, 0, 255 };
+
+		switch (kind) {
+		case NOISE:
+			for (int c = 0; c < 4; c++) {
+				value[c] = next_random(state);
+			}
+			break;
+		case GRADIENT:
+			value[0] = x;
+			value[1] = y;
+			value[2] = x ^ y;
+			value[3] = 255 - (x + y) / 8;
+			break;
+		case FLAT:
+			/* Long runs, which end in the middle of encoder blocks. */
+			value[0] = value[1] = value[2] = (i / 20000) * 40;
+			break;
+		case PALETTE:
+			value[0] = (next_random(state) % 6) * 50;
+			value[1] = value[0] / 2;
+			value[2] = 255 - value[0];
+			break;
+		default:
+			value[0] = x * 3;
+			value[1] = y * 5;
+			value[2] = 128;
+			value[3] = (x / 16 + y / 16) % 2 ? 255 : (x * 7) % 256;
+			break;
+		}
+
+		for (int c = 0; c < channels; c++) {
+			pixel[c] = value[c];
+		}
+	}
+}
+
+/**
+ * Returns the contents of the file at FILEPATH.
+ */
+std::vector<std::uint8_t> read_all(const char *filepath)
+{
+	std::ifstream file(filepath, std::ios::binary);
+	return { std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>() };
+}
+
+/**
+ * Returns PIXELS, with CHANNELS channels, with red and blue swapped.
+ */
+std::vector<std::uint8_t> swap_red_blue(std::span<const std::uint8_t> pixels, std::uint8_t channels)
+{
+	std::vector<std::uint8_t> swapped(pixels.begin(), pixels.end());
+	for (std::size_t i = 0; i < swapped.size(); i += channels) {
+		std::swap(swapped[i], swapped[i + 2]);
+	}
+
+	return swapped;
+}
+
+/**
+ * Decodes FILE in Layout, and returns whether every pixel matches the
+ * EXPECTED pixels, laid out the same way with CHANNELS channels.
+ */
+template <class Layout>
+bool decodes_to(
+		std::span<const std::uint8_t> file,
+		std::span<const std::uint8_t> expected,
+		std::uint8_t channels)
+{
+	std::size_t pixels = expected.size() / channels;
+	std::vector<std::uint8_t> decoded(pixels * Layout::channels);
+	qoi::decode<Layout>(file, decoded);
+
+	for (std::size_t i = 0; i < pixels; i++) {
+		for (std::size_t c = 0; c < Layout::channels; c++) {
+			std::uint8_t want = c < channels ? expected[i * channels + c] : 255;
+			if (decoded[i * Layout::channels + c] != want) {
+				return false;
+			}
+		}
+	}
+
+	return true;
+}
+
+/**
+ * Runs every check on one test image, and returns the number that failed.
+ */
+int check(const char *filepath, Content kind, std::uint32_t width, std::uint32_t height, qoi::Channels channels)
+{
+	qoi::Image image(width, height, qoi::Colorspace::srgb, channels);
+	fill(image, kind);
+	image.save(filepath);
+
+	std::vector<std::uint8_t> expected = read_all(filepath);
+	std::span<const std::uint8_t> raster = std::as_const(image).raster();
+	std::vector<std::uint8_t> swapped = swap_red_blue(raster, image.channels());
+	std::vector<std::uint8_t> encoded, encoded_bgr;
+	bool decoded;
+
+	if (channels == qoi::Channels::rgba) {
+		encoded = qoi::encode<qoi::Rgba>(raster, width, height);
+		encoded_bgr = qoi::encode<qoi::Bgra>(swapped, width, height);
+		decoded = decodes_to<qoi::Rgba>(expected, raster, 4) &&
+		          decodes_to<qoi::Bgra>(expected, swapped, 4);
+	} else {
+		encoded = qoi::encode<qoi::Rgb>(raster, width, height);
+		encoded_bgr = qoi::encode<qoi::Bgr>(swapped, width, height);
+		decoded = decodes_to<qoi::Rgb>(expected, raster, 3) &&
+		          decodes_to<qoi::Bgr>(expected, swapped, 3) &&
+		          decodes_to<qoi::Rgba>(expected, raster, 3);
+	}
+
+	int failures = 0;
+	auto report = [&](bool passed, const char *what) {
+		if (!passed) {
+			std::printf("FAIL: %s, %s, %ux%u, %d channels\n",
+			            what,
+			            content_names[kind],
+			            width,
+			            height,
+			            image.channels());
+			failures++;
+		}
+	};
+
+	report(encoded == expected, "qoi::encode differs from qoi_save");
+	report(encoded_bgr == expected, "BGR qoi::encode differs from qoi_save");
+	report(decoded, "qoi::decode differs from the raster");
+	return failures;
+}
+
+/**
+ * Checks that dimensions too large to be held in memory are refused before
+ * any buffer is sized from them, and returns the number of checks that
+ * failed. A header of 0x80000000 by 0x80000000 RGBA pixels gives a raster
+ * size that wraps to 0 in 64 bits.
+ */
+int check_oversized()
+{
+	std::uint8_t file[22] = { 'q', 'o', 'i', 'f', 0x80, 0, 0, 0, 0x80, 0, 0, 0, 4, 0 };
+	std::uint8_t pixels[4];
+	int failures = 0;
+
+	auto refused = [&](const char *what, auto operation) {
+		try {
+			operation();
+		} catch (const qoi::Error &error) {
+			if (error.code() == QOI_ERROR_MEMORY) {
+				return;
+			}
+		}
+
+		std::printf("FAIL: %s accepts oversized dimensions\n", what);
+		failures++;
+	};
+
+	refused("qoi::decode", [&] { qoi::decode<qoi::Rgba>(file, std::span<std::uint8_t>(pixels, 0)); });
+	refused("qoi::decode", [&] { qoi::decode<qoi::Rgb>(file, std::span<std::uint8_t>(pixels, 0)); });
+	refused("qoi::encode_into", [&] {
+		qoi::encode_into<qoi::Rgba>(std::span<const std::uint8_t>(pixels, 0),
+		                            0x80000000,
+		                            0x80000000,
+		                            std::span<std::uint8_t>(pixels, 0));
+	});
+	refused("qoi::max_encoded_size", [&] { qoi::max_encoded_size<qoi::Bgra>(0xFFFFFFFF, 0xFFFFFFFF); });
+	return failures;
+}
+
+} /* namespace */
+
+int main()
+{
+	char filepath[] = "/tmp/qoi_check_XXXXXX";
+	int fd = mkstemp(filepath);
+	if (fd == -1) {
+		std::perror("mkstemp");
+		return 1;
+	}
+	close(fd);
+
+	int failures = 0;
+	try {
+		for (int kind = 0; kind < CONTENT_COUNT; kind++) {
+			for (const auto &size : sizes) {
+				for (qoi::Channels channels : { qoi::Channels::rgb, qoi::Channels::rgba }) {
+					failures += check(filepath, static_cast<Content>(kind), size[0], size[1], channels);
+				}
+			}
+		}
+		failures += check_oversized();
+	} catch (const qoi::Error &error) {
+		std::printf("FAIL: %s\n", error.what());
+		failures++;
+	}
+
+	unlink(filepath);
+	if (failures != 0) {
+		return 1;
+	}
+
+	std::printf("qoi.hpp agrees with libqoi\n");
+	return 0;
+}
@@ -1,7 +1,19 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
 #include <stdlib.h>
 #include <stdio.h>
 #include <sys/stat.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
 #include "qoi.h"
 
 const QoiChannel QOI_CHANNEL_RGBA = 4;
@@ -10,8 +22,136 @@ const QoiChannel QOI_CHANNEL_RGB = 3;
 const QoiColorspace QOI_COLORSPACE_SRGB = 0;
 const QoiColorspace QOI_COLORSPACE_LINEAR = 1;
 
+const QoiHashType QOI_HASH_RASTER = 1;
+const QoiHashType QOI_HASH_ENCODED = 2;
+
+const QoiPhase QOI_PHASE_STAT = 0;
+const QoiPhase QOI_PHASE_READ = 1;
+const QoiPhase QOI_PHASE_DECODE = 2;
+const QoiPhase QOI_PHASE_ENCODE = 3;
+const QoiPhase QOI_PHASE_WRITE = 4;
+
+const QoiProperties QOI_PROPERTY_OPAQUE = 1;
+const QoiProperties QOI_PROPERTY_BINARY_ALPHA = 2;
+const QoiProperties QOI_PROPERTY_GRAYSCALE = 4;
+
 #define MIN(a,b) (((a)<(b)) * (a) + ((b)<=(a)) * (b))
 
+/**
+ * Marks a function that must be inlined into its callers, so that arguments
+ * that are constant there are folded into its body.
+ */
+#define QOI_ALWAYS_INLINE inline __attribute__((always_inline))
+
+/**
+ * Marks a USDT probe, which perf and bpftrace can attach to as qoi:NAME. Each
+ * probe is a single nop until a tool attaches to it. Probes are left out when
+ * <sys/sdt.h> is not available, or when QOI_NO_PROBES is defined.
+ */
+#if defined(__has_include) && !defined(QOI_NO_PROBES)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define QOI_PROBE(...) STAP_PROBEV(qoi, __VA_ARGS__)
+#endif
+#endif
+
+#ifndef QOI_PROBE
+#define QOI_PROBE(...) ((void) 0)
+#endif
+
+/**
+ * The size in bytes of the header at the start of a QOI file, and of the
+ * trailer at the end of it.
+ */
+#define QOI_HEADER_SIZE 14
+#define QOI_TRAILER_SIZE 8
+
+/**
+ * The size in bytes of the header at the start of a chunked QOI file. It is
+ * the same as a QOI header, followed by the strip height.
+ */
+#define QOI_CHUNKED_HEADER_SIZE 18
+
+/**
+ * The size in bytes of the header at the start of a shared raster. It holds a
+ * QOI header with the magic bytes "qoim", so that another process can find the
+ * dimensions of the raster that follows it.
+ */
+#define QOI_SHARED_HEADER_SIZE 4096
+
+/**
+ * The number of pixels that are encoded at a time when writing a file. The
+ * encoded form of a block is at most five bytes per pixel.
+ */
+#define QOI_BLOCK_PIXELS 16384
+
+/**
+ * The number of pixels that scan() tests at a time. The group of pixels is a
+ * whole number of 16 byte vectors, so that the loop over it is vectorized at
+ * -O2, where GCC only vectorizes loops that need no leftover iterations.
+ */
+#define QOI_SCAN_PIXELS 32
+
+/**
+ * The number of pixels in each strip of a chunked file when no strip height
+ * is given.
+ */
+#define QOI_DEFAULT_STRIP_PIXELS 65536
+
+/**
+ * The number of threads that read and write files for background loads and
+ * saves, which is how many of them can wait on storage at once. Decoding and
+ * encoding are done by one thread per processor.
+ */
+#define QOI_ASYNC_IO_THREADS 16
+
+/**
+ * The sampling done by qoi_estimate_encoded_size(). A run of
+ * QOI_ESTIMATE_SAMPLE_PIXELS pixels is measured from each of
+ * QOI_ESTIMATE_SAMPLES equal parts of the raster, from the codec state at its
+ * start, which is rebuilt from up to QOI_ESTIMATE_HISTORY_PIXELS pixels before
+ * it. The error bound is QOI_ESTIMATE_DEVIATIONS standard errors, plus what
+ * the history leaves unknown.
+ */
+#define QOI_ESTIMATE_SAMPLES 64
+#define QOI_ESTIMATE_SAMPLE_PIXELS 1024
+#define QOI_ESTIMATE_HISTORY_PIXELS 16384
+#define QOI_ESTIMATE_DEVIATIONS 3
+
+/**
+ * The parameters of the compression used by compressed QOI files. Matches are
+ * at least QOI_LZ_MIN_MATCH bytes, and can refer back up to QOI_LZ_WINDOW
+ * bytes, including into earlier blocks. Each block starts with a header of
+ * its pixel count, its size, and its compressed size.
+ */
+#define QOI_LZ_MIN_MATCH 4
+#define QOI_LZ_WINDOW 65535
+#define QOI_LZ_HASH_BITS 14
+#define QOI_LZ_TABLE_SIZE (1 << QOI_LZ_HASH_BITS)
+#define QOI_LZ_BLOCK_HEADER_SIZE 12
+
+/**
+ * The largest size that N bytes can be compressed into.
+ */
+#define QOI_LZ_BOUND(n) ((n) + (n) / 255 + 16)
+
+/**
+ * The size in bytes of the header at the start of a sequence file, and of the
+ * footer at the end of it. The footer holds the frame count and a magic
+ * number, and is preceded by the offset of each frame.
+ */
+#define QOI_SEQUENCE_HEADER_SIZE 4
+#define QOI_SEQUENCE_FOOTER_SIZE 8
+
+/**
+ * The primes used by the XXH64 hash.
+ */
+#define QOI_HASH_PRIME1 0x9E3779B185EBCA87ull
+#define QOI_HASH_PRIME2 0xC2B2AE3D27D4EB4Full
+#define QOI_HASH_PRIME3 0x165667B19E3779F9ull
+#define QOI_HASH_PRIME4 0x85EBCA77C2B2AE63ull
+#define QOI_HASH_PRIME5 0x27D4EB2F165667C5ull
+
 /**
  * The following series of macros are for testing what operator is indicated
  * by the input byte.
@@ -23,20 +163,27 @@ const QoiColorspace QOI_COLORSPACE_LINEAR = 1;
 #define IS_QOI_OP_LUMA(b)  ((b & 0b11000000) == 0b10000000)
 #define IS_QOI_OP_RUN(b)   ((b & 0b11000000) == 0b11000000)
 
+/**
+ * The first value past the error codes declared in qoi.h.
+ */
+#define QOI_INVALID_ERROR_CODE (QOI_ERROR_OUT_OF_RANGE + 1)
+
 /**
  * Contains the error code for the previous error.
  */
-enum
-{
-	QOI_ERROR_NONE,
-	QOI_ERROR_PERMISSIONS,
-	QOI_ERROR_MEMORY,
-	QOI_ERROR_FILE_CONTENT,
-	QOI_ERROR_NOT_QOI_FILE,
-	QOI_ERROR_DISK_SPACE,
-	QOI_INVALID_ERROR_CODE
-};
-int qoi_error = QOI_ERROR_NONE;
+_Thread_local int qoi_error = QOI_ERROR_NONE;
+
+/**
+ * The function that is passed the time taken by each phase of a load or save.
+ */
+typedef void (*trace_function)(QoiPhase, uint64_t, uint64_t, uint64_t, void*);
+
+/**
+ * The trace callback set by qoi_set_trace_callback(), and the data it is
+ * called with.
+ */
+static _Atomic trace_function trace_callback = NULL;
+static void *_Atomic trace_userdata = NULL;
 
 /**
  * The string representations of the above errors.
@@ -48,6 +195,7 @@ static const char *(qoi_strerror_messages)[] = {
 	"File could not be read",
 	"File is not a valid QOI file",
 	"Insufficient disk space to save file",
+	"Requested part of the file does not exist",
 	"Warning: Not a valid error code"
 };
 
@@ -63,6 +211,60 @@ typedef struct Qoi
 	void (*freer)(void*);
 } Qoi;
 
+/**
+ * Represents a load or save operation. A load reads the file on an I/O worker
+ * and then decodes it on a codec worker, and a save does the same in the
+ * other order, with BUFFER and SIZE holding the file data between the two.
+ * STEP is what is left to run once the operation leaves its queue, and NEXT
+ * links it into that queue. SOURCE is NULL for loads, and RESULT is unused for
+ * saves. The eventfd FD is signalled once the operation has finished, and
+ * FINISHED is set under LOCK once its callback has returned.
+ */
+typedef struct QoiAsync
+{
+	struct QoiAsync *next;
+	void (*step)(struct QoiAsync*);
+	int fd;
+	char finished;
+	pthread_mutex_t lock;
+	pthread_cond_t done;
+	char *filepath;
+	const Qoi *source;
+	unsigned char *buffer;
+	size_t size;
+	Qoi *result;
+	int error;
+	void (*callback)(QoiAsync*, void*);
+	void *userdata;
+} QoiAsync;
+
+/**
+ * A sequence file mapped into memory. INDEX is a copy of the frame offsets,
+ * which were held in the mapping at INDEX_START, as appending to the file
+ * overwrites them there. When PREFETCH is not 0, that many frames after each
+ * decoded frame are read ahead.
+ */
+typedef struct QoiSequence
+{
+	unsigned char *map;
+	size_t size;
+	uint32_t frame_count;
+	unsigned char *index;
+	uint64_t index_start;
+	uint32_t prefetch;
+} QoiSequence;
+
+/**
+ * Kept in a private page just before the mapping of a shared raster, so that
+ * the raster can be unmapped given only a pointer to it. FD is the memfd
+ * holding the raster, and SIZE is the size of the whole mapping.
+ */
+typedef struct
+{
+	int fd;
+	size_t size;
+} shared_mapping;
+
 /**
  * Represents a typical 32-bit RGBA color.
  */
@@ -71,6 +273,105 @@ typedef struct
 	uint8_t r, g, b, a;
 } color;
 
+/**
+ * The state carried from one pixel to the next by the encoder and decoder.
+ * RUN is the number of pixels of a QOI_OP_RUN that the decoder has yet to
+ * write, or that the encoder has already written the operation for.
+ */
+typedef struct
+{
+	color last_color;
+	color previous_colors[64];
+	int run;
+} codec_state;
+
+/**
+ * The state of an XXH64 hash (with a seed of 0) being computed over a series
+ * of bytes given a piece at a time. BUFFER holds the bytes that do not yet
+ * fill a 32 byte stripe.
+ */
+typedef struct
+{
+	uint64_t lanes[4];
+	uint64_t length;
+	uint8_t buffer[32];
+	size_t buffered;
+} hasher;
+
+/**
+ * The trace callback as it was when a load or save began, so that its phases
+ * are either all timed or all left untimed. CALLBACK is NULL when nothing is
+ * to be timed.
+ */
+typedef struct
+{
+	trace_function callback;
+	void *userdata;
+} tracer;
+
+/**
+ * Describes a chunked file whose strips are being encoded or decoded in
+ * parallel. When encoding, each strip is written to its own buffer in STRIPS.
+ * When decoding, INPUT holds the whole file and OFFSETS points at its strip
+ * table. ERROR is set if any strip fails.
+ */
+typedef struct
+{
+	const Qoi *image;
+	uint32_t strip_height;
+	unsigned char **strips;
+	size_t *sizes;
+	const unsigned char *input;
+	const unsigned char *offsets;
+	atomic_int error;
+} chunked_job;
+
+/**
+ * Describes a set of COUNT independent tasks shared between threads. Each
+ * thread claims the index NEXT until every task has been run.
+ */
+typedef struct
+{
+	void (*task)(void*, size_t);
+	void *context;
+	size_t count;
+	atomic_size_t next;
+} parallel_job;
+
+/**
+ * A queue of operations waiting for a step, from HEAD to TAIL, and the number
+ * of worker threads taking operations from it. If no threads could be
+ * started, each step is run by the thread that queues it.
+ */
+typedef struct
+{
+	pthread_mutex_t lock;
+	pthread_cond_t ready;
+	QoiAsync *head, *tail;
+	size_t threads;
+} async_pool;
+
+/**
+ * The pool that reads and writes files, and the pool that decodes and encodes
+ * them. Their threads are started by the first background operation.
+ */
+static async_pool io_pool = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, NULL, 0 };
+static async_pool codec_pool = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, NULL, 0 };
+static pthread_once_t async_pools_started = PTHREAD_ONCE_INIT;
+
+/**
+ * A mask over the bytes of QOI_SCAN_PIXELS RGB pixels, which selects the red
+ * and green bytes. scan() compares each of them with the byte after it.
+ */
+#define QOI_SCAN_RGB_MASK 0xFF, 0xFF, 0
+#define QOI_SCAN_RGB_MASK8 QOI_SCAN_RGB_MASK, QOI_SCAN_RGB_MASK, QOI_SCAN_RGB_MASK, \
+                           QOI_SCAN_RGB_MASK, QOI_SCAN_RGB_MASK, QOI_SCAN_RGB_MASK, \
+                           QOI_SCAN_RGB_MASK, QOI_SCAN_RGB_MASK
+
+static const uint8_t scan_rgb_mask[QOI_SCAN_PIXELS * 3] = {
+	QOI_SCAN_RGB_MASK8, QOI_SCAN_RGB_MASK8, QOI_SCAN_RGB_MASK8, QOI_SCAN_RGB_MASK8
+};
+
 /**
  * Returns 1 if the two colors are equal on all parts, 0 otherwise.
  */
@@ -107,6 +408,20 @@ static void big_endian_r(
 		char *output,
 		const uint32_t input);
 
+/**
+ * Converts the given eight bytes into a 64 bit number by interpreting the
+ * bytes as big endian.
+ */
+static uint64_t big_endian64(
+		const unsigned char *raw);
+
+/**
+ * Stores the 64 bit numerical INPUT into a big endian array OUTPUT.
+ */
+static void big_endian64_r(
+		char *output,
+		const uint64_t input);
+
 /**
  * Retrieves the size in bytes of the file given by the FILEPATH.
  */
@@ -114,620 +429,4041 @@ static ssize_t filesize(
 		const char *filepath);
 
 /**
- * Decodes the raw file data INPUT into a pixel buffer OUTPUT. Returns 0 on
- * success and -1 on failure. qoi_error is set to indicate the error.
+ * Reads the whole of the file given by the FILEPATH into a newly allocated
+ * buffer, and stores its size in SIZE. Returns NULL on failure, with qoi_error
+ * set to indicate why.
  */
-static int decode(
-		const unsigned char *input,
-		char *output,
-		const size_t output_size,
-		const char has_alpha_channel);
+static unsigned char *read_file(
+		const char *filepath,
+		size_t *size);
 
 /**
- * Encodes the pixel data in SELF and writes it into the FILE. The FILE should
- * already be open, and will not be closed by this function. Returns 0 on
- * success and -1 on error, with qoi_error set to indicate why. This does not
- * write the header nor the trailer.
+ * Stores the size in bytes of the raster of an image with the given
+ * dimensions in SIZE. Returns 0 if the raster is too large, and 1 otherwise.
  */
-static int encode(
-		const Qoi *self,
-		FILE *file);
+static int raster_size(
+		const uint32_t width,
+		const uint32_t height,
+		const QoiChannel channels,
+		size_t *size);
 
 /**
- * Returns the index in the ARRAY that contains the given VALUE.
+ * Allocates a raster for an image with the given dimensions. Returns NULL if
+ * the raster is too large or cannot be allocated.
  */
-static int index_of(
-		const color *array,
-		const size_t arraylen,
-		const color value);
+static uint8_t *allocate_raster(
+		const uint32_t width,
+		const uint32_t height,
+		const QoiChannel channels);
 
 /**
- * Returns 1 if the two colors are equal on all parts, 0 otherwise.
+ * Allocates a raster for an image with the given specifications in a new
+ * memfd, after a header that describes it. Returns NULL if the raster is too
+ * large or cannot be allocated. The raster should be freed using
+ * free_shared().
  */
-static char color_equal(
-		const color c1,
-		const color c2)
-{
-	return c1.r == c2.r && c1.g == c2.g && c1.b == c2.b && c1.a == c2.a;
-}
+static uint8_t *allocate_shared_raster(
+		const uint32_t width,
+		const uint32_t height,
+		const QoiColorspace colorspace,
+		const QoiChannel channels);
 
 /**
- * Creates a color from the three our four bytes in INPUT, the size of which is
- * determined by CHANNELS (3 for RGB, 4 for RGBA). The order of the bytes is
- * RGB(A) and if no alpha channel is present, it is set to 255.
+ * Maps the SIZE bytes of the memfd FD, which holds a shared raster after its
+ * header, and makes the mapping the owner of FD. Returns the raster, or NULL
+ * on failure.
  */
-static color create_color(
-		const uint8_t *input,
-		const QoiChannel channels)
-{
-	color c;
-	c.r = input[0];
-	c.g = input[1];
-	c.b = input[2];
-	c.a = channels == QOI_CHANNEL_RGBA ? input[3] : 255;
+static uint8_t *map_shared(
+		const int fd,
+		const size_t size);
 
-	return c;
-}
+/**
+ * Returns the information kept before the shared raster RASTER.
+ */
+static shared_mapping *find_mapping(
+		const void *raster);
 
 /**
- * Determines the QOI hash of the color, used for indexing into the 'previous
- * colors' array.
+ * Unmaps a shared raster, and closes its memfd.
  */
-static int color_hash(
-		const color c)
-{
-		return (c.r * 3 + c.g * 5 + c.b * 7 + c.a * 11) % 64;
-}
+static void free_shared(
+		void *raster);
 
 /**
- * Construct a new initially blank QOI object with certain spectifications.
- * If there is an error, this returns NULL, and qoi_errno() can be used to find
- * out why. The returned object should be freed using qoi_free() when no longer
- * needed.
+ * Constructs a new QOI object from the SIZE bytes of QOI file data in INPUT.
+ * The raster has CHANNELS channels, or those of the file if CHANNELS is 0, and
+ * is allocated using allocate_shared_raster() if SHARED is set.
+ * The raster and the file data are added to the hashers RASTER and ENCODED,
+ * unless they are NULL. Returns NULL on failure, with qoi_error set to
+ * indicate why.
  */
-Qoi *qoi_new(
-		uint32_t width,
-		uint32_t height,
-		QoiColorspace colorspace,
-		QoiChannel channels)
-{
-	return qoi_new_from_data(
-			width,
-			height,
-			colorspace,
-			channels,
-			malloc(width * height * channels),
-			free);
-}
+static Qoi *parse(
+		const unsigned char *input,
+		const size_t size,
+		const QoiChannel output_channels,
+		const char shared,
+		hasher *raster,
+		hasher *encoded);
 
 /**
- * Construct a new QOI object using the given specifications with some initial
- * image data. The QOI object takes ownership of the data, and will free it
- * using the freeing function when qoi_free() is called. The buffer should be
- * width * height * (3 or 4) bytes, 3 if the colorspace is RGB and 4 if the
- * colorspace is RGBA.
+ * Writes the header fields of SELF, preceded by the four byte MAGIC, into
+ * the first 14 bytes of OUTPUT.
  */
-Qoi *qoi_new_from_data(
-		uint32_t width,
-		uint32_t height,
-		QoiColorspace colorspace,
-		QoiChannel channels,
-		void *image_buffer,
-		void (*freeing_function)(void*))
-{
-	Qoi *self = malloc(sizeof(Qoi));
-	self->width = width;
-	self->height = height;
-	self->channels = channels;
-	self->colorspace = colorspace;
-	self->freer = freeing_function;
-	self->data = image_buffer;
-	return self;
-}
+static void make_header(
+		const Qoi *self,
+		const char *magic,
+		char *output);
 
 /**
- * Construct a new QOI object from a QOI file. If the file is not valid,
- * this returns NULL, and qoi_errno() can be used to find out why. The returned
- * object should be freed using qoi_free() when no longer needed.
+ * Resets STATE to the state at the start of a QOI stream.
  */
-Qoi *qoi_new_from_file(
-		const char *filepath)
-{
-	/* Get the size of the input file. */
-	ssize_t size = filesize(filepath);
-	if (size == -1) {
-		qoi_error = QOI_ERROR_PERMISSIONS;
-		return NULL;
-	}
+static void codec_state_init(
+		codec_state *state);
 
-	/* Allocate space for the file header and content. */
-	unsigned char *file_buffer = malloc(size);
+/**
+ * Decodes PIXEL_COUNT pixels from the INPUT_SIZE bytes of QOI operations in
+ * INPUT into the pixel buffer OUTPUT, continuing on from STATE. Returns the
+ * number of bytes of INPUT used, or -1 if INPUT ends too early.
+ */
+static ssize_t decode(
+		codec_state *state,
+		const unsigned char *input,
+		const size_t input_size,
+		uint8_t *output,
+		const size_t pixel_count,
+		const QoiChannel channels);
 
-	if (file_buffer == NULL) {
-		if (file_buffer   != NULL) free(file_buffer);
-		qoi_error = QOI_ERROR_MEMORY;
-		return NULL;
-	}
+/**
+ * The body of decode(), inlined once for each channel count.
+ */
+static QOI_ALWAYS_INLINE ssize_t decode_channels(
+		codec_state *state,
+		const unsigned char *input,
+		const size_t input_size,
+		uint8_t *output,
+		const size_t pixel_count,
+		const QoiChannel channels);
 
-	/* Open the file. */
-	FILE *file = fopen(filepath, "rb");
-	if (file == NULL) {
-		qoi_error = QOI_ERROR_PERMISSIONS;
-		free(file_buffer);
-		return NULL;
-	}
+/**
+ * Encodes PIXEL_COUNT pixels from INPUT into QOI operations in OUTPUT,
+ * continuing on from STATE. A run may carry on past the last pixel, up to the
+ * AVAILABLE pixels in INPUT, in which case the next call skips the rest of it.
+ * OUTPUT must have room for CHANNELS + 1 bytes per pixel. Returns the number of
+ * bytes written to OUTPUT.
+ */
+static size_t encode(
+		codec_state *state,
+		const uint8_t *input,
+		const size_t pixel_count,
+		const size_t available,
+		const QoiChannel channels,
+		uint8_t *output);
 
-	/* Read the header and file body. */
-	size_t bytes_read = fread(file_buffer, 1, size, file);
-	fclose(file);
-	if (bytes_read != size) {
-		qoi_error = QOI_ERROR_FILE_CONTENT;
-		free(file_buffer);
-		return NULL;
-	}
+/**
+ * The body of encode() and of measure(), inlined once for each channel count.
+ * If OUTPUT is NULL, the operations are chosen but only their bytes counted.
+ */
+static QOI_ALWAYS_INLINE size_t encode_channels(
+		codec_state *state,
+		const uint8_t *input,
+		const size_t pixel_count,
+		const size_t available,
+		const QoiChannel channels,
+		uint8_t *output);
 
-	/* Ensure the file is a QOI file. */
-	if (file_buffer[0] != 'q' ||
-	    file_buffer[1] != 'o' ||
-	    file_buffer[2] != 'i' ||
-	    file_buffer[3] != 'f') {
+/**
+ * Returns the number of bytes that encode() would write for PIXEL_COUNT pixels
+ * from INPUT, continuing on from STATE, without writing them. Runs end at the
+ * last pixel.
+ */
+static size_t measure(
+		codec_state *state,
+		const uint8_t *input,
+		const size_t pixel_count,
+		const QoiChannel channels);
 
-		qoi_error = QOI_ERROR_NOT_QOI_FILE;
-		free(file_buffer);
-		return NULL;
-	}
+/**
+ * Returns the share of the bytes of the file that qoi_save() would write for
+ * SELF that falls to the pixels from FIRST up to LAST. The bound on the error
+ * of the share, from history that is not followed far enough back, is added
+ * to UNCERTAINTY.
+ */
+static double measure_span(
+		const Qoi *self,
+		const size_t first,
+		const size_t last,
+		double *uncertainty);
 
-	/* Get the header attributes, and allocate space for pixel data. */
-	uint32_t width = big_endian(file_buffer + 4);
-   	uint32_t height = big_endian(file_buffer + 8);
-	QoiChannel channels = file_buffer[12];
-	QoiColorspace colorspace = file_buffer[13];
-	char *pixel_data = malloc(width * height * channels);
+/**
+ * Returns the share of the bytes of a run of the color RUN_COLOR that falls
+ * to the COUNT pixels of SELF from START, all of which are in the run. The
+ * bound on the error of the share is added to UNCERTAINTY.
+ */
+static double run_share(
+		const Qoi *self,
+		const size_t start,
+		const size_t count,
+		const color run_color,
+		double *uncertainty);
+
+/**
+ * Returns the share of the bytes of the file that falls to the
+ * QOI_ESTIMATE_SAMPLE_PIXELS pixels of SELF from START, adding the bound on
+ * its error to UNCERTAINTY. A sample that runs off the end of the raster
+ * continues from its start.
+ */
+static double measure_sample(
+		const Qoi *self,
+		const size_t start,
+		double *uncertainty);
+
+/**
+ * Returns the square root of VALUE, or 0 if VALUE is not positive.
+ */
+static double square_root(
+		const double value);
+
+/**
+ * Returns the properties shared by all of the PIXEL_COUNT pixels in INPUT.
+ */
+static QoiProperties scan(
+		const uint8_t *input,
+		const size_t pixel_count,
+		const QoiChannel channels);
+
+/**
+ * The body of scan(), inlined once for each channel count.
+ */
+static QOI_ALWAYS_INLINE QoiProperties scan_channels(
+		const uint8_t *input,
+		const size_t pixel_count,
+		const QoiChannel channels);
+
+/**
+ * Encodes the pixel data in SELF and writes it into the FILE, compressing it
+ * if COMPRESSED is set. The time taken writing is added to WRITE_TIME, or if
+ * it is NULL, the FILE is a memory stream and writing to it is traced as
+ * encoding. The properties of the pixels are stored
+ * in PROPERTIES, unless it is NULL. The FILE should already be open, and will
+ * not be closed by this function. Returns 0 on success and a qoi_error code on
+ * failure. This does not write the header nor the trailer.
+ */
+static int encode_to_file(
+		const Qoi *self,
+		FILE *file,
+		const char compressed,
+		uint64_t *write_time,
+		hasher *raster,
+		hasher *encoded,
+		QoiProperties *properties);
+
+/**
+ * Saves SELF to the file given by FILEPATH, as a .qoi file or, if COMPRESSED
+ * is set, as a compressed QOI file. The raster and the file data are added to
+ * the hashers RASTER and ENCODED, unless they are NULL. If PROPERTIES is not
+ * NULL, the properties of the image are stored in it, and an opaque image is
+ * saved with 3 channels. On success returns 0, otherwise returns -1, with
+ * qoi_error set to indicate why.
+ */
+static int save_file(
+		const Qoi *self,
+		const char *filepath,
+		const char compressed,
+		hasher *raster,
+		hasher *encoded,
+		QoiProperties *properties);
+
+/**
+ * Writes SELF into FILE as a .qoi file or, if COMPRESSED is set, as a
+ * compressed QOI file, adding the time taken writing to WRITE_TIME, or tracing
+ * writes as encoding if it is NULL. The properties of the image are stored in
+ * PROPERTIES, unless it is NULL. The FILE should already be open, and will not
+ * be closed by this function. Returns 0 on success and a qoi_error code on
+ * failure.
+ */
+static int write_file(
+		const Qoi *self,
+		FILE *file,
+		const char compressed,
+		uint64_t *write_time,
+		hasher *raster,
+		hasher *encoded,
+		QoiProperties *properties);
+
+/**
+ * Returns the offset in the sequence SELF at which the frame at INDEX starts.
+ * The frame count itself gives the offset of the end of the last frame.
+ */
+static uint64_t frame_offset(
+		const QoiSequence *self,
+		const uint32_t index);
+
+/**
+ * Resets HASHER to hash a new series of bytes.
+ */
+static void hasher_init(
+		hasher *self);
+
+/**
+ * Reads the eight bytes at RAW as a little endian 64 bit number.
+ */
+static uint64_t little_endian64(
+		const uint8_t *raw);
+
+/**
+ * Rotates the bits of VALUE left by COUNT places.
+ */
+static uint64_t rotate_left(
+		const uint64_t value,
+		const int count);
+
+/**
+ * Mixes the eight bytes of INPUT into the hash lane ACCUMULATOR.
+ */
+static uint64_t hash_round(
+		uint64_t accumulator,
+		const uint64_t input);
+
+/**
+ * Mixes each of the 32 byte stripes in INPUT into the lanes of HASHER.
+ */
+static void hasher_stripes(
+		hasher *self,
+		const uint8_t *input,
+		const size_t size);
+
+/**
+ * Adds the SIZE bytes of INPUT to the bytes hashed by HASHER.
+ */
+static void hasher_update(
+		hasher *self,
+		const uint8_t *input,
+		size_t size);
+
+/**
+ * Returns the hash of all of the bytes given to HASHER.
+ */
+static uint64_t hasher_final(
+		const hasher *self);
+
+/**
+ * Takes a copy of the current trace callback into TRACER.
+ */
+static void tracer_init(
+		tracer *self);
+
+/**
+ * Returns the current time in nanoseconds if TRACER has a callback, and 0 if
+ * it does not, so that the clock is only read while tracing.
+ */
+static uint64_t tracer_clock(
+		const tracer *self);
+
+/**
+ * Passes the NANOSECONDS taken by PHASE, and the BYTES and PIXELS handled by
+ * it, to the callback of TRACER, if it has one.
+ */
+static void tracer_report(
+		const tracer *self,
+		const QoiPhase phase,
+		const uint64_t nanoseconds,
+		const uint64_t bytes,
+		const uint64_t pixels);
+
+/**
+ * Reads the compressed blocks of a compressed QOI file from FILE, and decodes
+ * them into the raster of SELF. The FILE should already be open and past the
+ * header, and will not be closed by this function. Returns 0 on success and a
+ * qoi_error code on failure.
+ */
+static int decode_from_file(
+		Qoi *self,
+		FILE *file);
+
+/**
+ * Returns the hash of the four bytes at INPUT, used for indexing into the
+ * match table of the compressor.
+ */
+static uint32_t lz_hash(
+		const uint8_t *input);
+
+/**
+ * Stores the part of LENGTH that does not fit in a four bit token field into
+ * OUTPUT. Returns the number of bytes written.
+ */
+static size_t lz_write_length(
+		uint8_t *output,
+		size_t length);
+
+/**
+ * Adds the bytes written by lz_write_length() at INPUT onto LENGTH. Returns 0
+ * on success and -1 if INPUT ends too early.
+ */
+static int lz_read_length(
+		const uint8_t *input,
+		const size_t input_size,
+		size_t *input_index,
+		size_t *length);
+
+/**
+ * Writes a sequence of literals followed by a match into OUTPUT. Returns the
+ * number of bytes written.
+ */
+static size_t lz_write_sequence(
+		uint8_t *output,
+		const uint8_t *literals,
+		const size_t literal_length,
+		const size_t offset,
+		const size_t match_length);
+
+/**
+ * Compresses the bytes of WINDOW from START up to END into OUTPUT. Returns the
+ * number of bytes written.
+ */
+static size_t lz_compress(
+		const uint8_t *window,
+		const size_t start,
+		const size_t end,
+		uint32_t *table,
+		uint8_t *output);
+
+/**
+ * Decompresses INPUT into WINDOW from START. Returns the number of bytes
+ * written, or -1 if INPUT is not valid.
+ */
+static ssize_t lz_decompress(
+		const uint8_t *input,
+		const size_t input_size,
+		uint8_t *window,
+		const size_t start,
+		const size_t capacity);
+
+/**
+ * Keeps only the last QOI_LZ_WINDOW of the LENGTH bytes in WINDOW. Returns the
+ * number of bytes kept.
+ */
+static size_t slide_window(
+		uint8_t *window,
+		const size_t length,
+		uint32_t *table);
+
+/**
+ * Returns the index in the ARRAY that contains the given VALUE.
+ */
+static int index_of(
+		const color *array,
+		const size_t arraylen,
+		const color value);
+
+/**
+ * Allocates an operation and queues its first STEP on POOL. Returns NULL on
+ * failure, with qoi_error set to indicate why.
+ */
+static QoiAsync *async_start(
+		const char *filepath,
+		const Qoi *source,
+		async_pool *pool,
+		void (*step)(QoiAsync*),
+		void (*callback)(QoiAsync*, void*),
+		void *userdata);
+
+/**
+ * Starts the worker threads of the I/O and codec pools. Called once, by the
+ * first background operation.
+ */
+static void async_start_pools(void);
+
+/**
+ * Queues the operation OP on POOL, to have STEP run on it by one of the
+ * pool's workers.
+ */
+static void async_queue(
+		async_pool *pool,
+		QoiAsync *op,
+		void (*step)(QoiAsync*));
+
+/**
+ * The thread routine of a worker, which runs the steps queued on the
+ * async_pool POOL for as long as the process lasts.
+ */
+static void *async_worker(
+		void *pool);
+
+/**
+ * The I/O step of qoi_new_from_file_async(), which reads the file.
+ */
+static void async_read(
+		QoiAsync *op);
+
+/**
+ * The codec step of qoi_new_from_file_async(), which decodes the file read by
+ * async_read().
+ */
+static void async_decode(
+		QoiAsync *op);
+
+/**
+ * The codec step of qoi_save_async(), which encodes the image into memory.
+ */
+static void async_encode(
+		QoiAsync *op);
+
+/**
+ * The I/O step of qoi_save_async(), which writes the file encoded by
+ * async_encode().
+ */
+static void async_write(
+		QoiAsync *op);
+
+/**
+ * Signals the completion of the operation OP and runs its callback.
+ */
+static void async_finish(
+		QoiAsync *op);
+
+/**
+ * Returns the number of strips in a chunked image with the given HEIGHT and
+ * STRIP_HEIGHT.
+ */
+static size_t strip_count(
+		const uint32_t height,
+		const uint32_t strip_height);
+
+/**
+ * Encodes the strip at INDEX of the chunked_job JOB into a new buffer.
+ */
+static void encode_strip(
+		void *job,
+		size_t index);
+
+/**
+ * Decodes the strip at INDEX of the chunked_job JOB into the image raster.
+ */
+static void decode_strip(
+		void *job,
+		size_t index);
+
+/**
+ * Runs TASK on each index below COUNT, spreading the calls between as many
+ * threads as there are processors. CONTEXT is passed to each call.
+ */
+static void run_parallel(
+		void (*task)(void*, size_t),
+		void *context,
+		const size_t count);
+
+/**
+ * The thread routine for run_parallel().
+ */
+static void *parallel_worker(
+		void *job);
+
+/**
+ * Returns 1 if the two colors are equal on all parts, 0 otherwise.
+ */
+static char color_equal(
+		const color c1,
+		const color c2)
+{
+	return c1.r == c2.r && c1.g == c2.g && c1.b == c2.b && c1.a == c2.a;
+}
+
+/**
+ * Creates a color from the three our four bytes in INPUT, the size of which is
+ * determined by CHANNELS (3 for RGB, 4 for RGBA). The order of the bytes is
+ * RGB(A) and if no alpha channel is present, it is set to 255.
+ */
+static color create_color(
+		const uint8_t *input,
+		const QoiChannel channels)
+{
+	color c;
+	c.r = input[0];
+	c.g = input[1];
+	c.b = input[2];
+	c.a = channels == QOI_CHANNEL_RGBA ? input[3] : 255;
+
+	return c;
+}
+
+/**
+ * Determines the QOI hash of the color, used for indexing into the 'previous
+ * colors' array.
+ */
+static int color_hash(
+		const color c)
+{
+		return (c.r * 3 + c.g * 5 + c.b * 7 + c.a * 11) % 64;
+}
+
+/**
+ * Construct a new initially blank QOI object with certain spectifications.
+ * If there is an error, this returns NULL, and qoi_errno() can be used to find
+ * out why. The returned object should be freed using qoi_free() when no longer
+ * needed.
+ */
+Qoi *qoi_new(
+		uint32_t width,
+		uint32_t height,
+		QoiColorspace colorspace,
+		QoiChannel channels)
+{
+	return qoi_new_from_data(
+			width,
+			height,
+			colorspace,
+			channels,
+			allocate_raster(width, height, channels),
+			free);
+}
+
+/**
+ * Construct a new QOI object using the given specifications with some initial
+ * image data. The QOI object takes ownership of the data, and will free it
+ * using the freeing function when qoi_free() is called. The buffer should be
+ * width * height * (3 or 4) bytes, 3 if the colorspace is RGB and 4 if the
+ * colorspace is RGBA.
+ */
+Qoi *qoi_new_from_data(
+		uint32_t width,
+		uint32_t height,
+		QoiColorspace colorspace,
+		QoiChannel channels,
+		void *image_buffer,
+		void (*freeing_function)(void*))
+{
+	if (image_buffer == NULL) {
+		qoi_error = QOI_ERROR_MEMORY;
+		return NULL;
+	}
+
+	Qoi *self = malloc(sizeof(Qoi));
+	if (self == NULL) {
+		qoi_error = QOI_ERROR_MEMORY;
+		if (freeing_function != NULL) {
+			freeing_function(image_buffer);
+		}
+		return NULL;
+	}
+
+	self->width = width;
+	self->height = height;
+	self->channels = channels;
+	self->colorspace = colorspace;
+	self->freer = freeing_function;
+	self->data = image_buffer;
+	return self;
+}
+
+/**
+ * Construct a new QOI object from a QOI file. If the file is not valid,
+ * this returns NULL, and qoi_errno() can be used to find out why. The returned
+ * object should be freed using qoi_free() when no longer needed.
+ */
+Qoi *qoi_new_from_file(
+		const char *filepath)
+{
+	size_t size;
+	unsigned char *file_buffer = read_file(filepath, &size);
+	if (file_buffer == NULL) {
+		return NULL;
+	}
+
+	Qoi *self = parse(file_buffer, size, 0, 0, NULL, NULL);
+	free(file_buffer);
+	return self;
+}
+
+/**
+ * Construct a new QOI object from a QOI file, as qoi_new_from_file() does, but
+ * with CHANNELS channels whatever the channel count of the file. Alpha is
+ * dropped or set to 255 as each pixel is decoded. CHANNELS should be
+ * QOI_CHANNEL_RGB or QOI_CHANNEL_RGBA; any other value keeps the channel count
+ * of the file. If the file is not valid, this returns NULL, and qoi_errno()
+ * can be used to find out why. The returned object should be freed using
+ * qoi_free() when no longer needed.
+ */
+Qoi *qoi_new_from_file_channels(
+		const char *filepath,
+		QoiChannel channels)
+{
+	if (channels != QOI_CHANNEL_RGB && channels != QOI_CHANNEL_RGBA) {
+		channels = 0;
+	}
+
+	size_t size;
+	unsigned char *file_buffer = read_file(filepath, &size);
+	if (file_buffer == NULL) {
+		return NULL;
+	}
+
+	Qoi *self = parse(file_buffer, size, channels, 0, NULL, NULL);
+	free(file_buffer);
+	return self;
+}
+
+/**
+ * Construct a new QOI object from a QOI file, as qoi_new_from_file() does, and
+ * compute the content hashes selected by TYPES into HASH while decoding. The
+ * hashes cost little extra, as each block of the file is hashed just after it
+ * is decoded. If the file is not valid, this returns NULL, and qoi_errno() can
+ * be used to find out why. The returned object should be freed using
+ * qoi_free() when no longer needed.
+ */
+Qoi *qoi_new_from_file_hashed(
+		const char *filepath,
+		QoiHashType types,
+		QoiHash *hash)
+{
+	size_t size;
+	unsigned char *file_buffer = read_file(filepath, &size);
+	if (file_buffer == NULL) {
+		return NULL;
+	}
+
+	hasher raster, encoded;
+	hasher_init(&raster);
+	hasher_init(&encoded);
+
+	Qoi *self = parse(file_buffer,
+	                  size,
+	                  0,
+	                  0,
+	                  types & QOI_HASH_RASTER ? &raster : NULL,
+	                  types & QOI_HASH_ENCODED ? &encoded : NULL);
+	free(file_buffer);
+
+	hash->raster = types & QOI_HASH_RASTER ? hasher_final(&raster) : 0;
+	hash->encoded = types & QOI_HASH_ENCODED ? hasher_final(&encoded) : 0;
+	return self;
+}
+
+/**
+ * Construct a new initially blank QOI object, as qoi_new() does, with its
+ * raster held in a memfd. The descriptor can be got with qoi_get_fd() and
+ * passed to another process, which can then use qoi_new_from_fd() to map the
+ * same raster without copying it. If there is an error, this returns NULL,
+ * and qoi_errno() can be used to find out why. The returned object should be
+ * freed using qoi_free() when no longer needed.
+ */
+Qoi *qoi_new_shared(
+		uint32_t width,
+		uint32_t height,
+		QoiColorspace colorspace,
+		QoiChannel channels)
+{
+	return qoi_new_from_data(
+			width,
+			height,
+			colorspace,
+			channels,
+			allocate_shared_raster(width, height, colorspace, channels),
+			free_shared);
+}
+
+/**
+ * Construct a new QOI object from a QOI file, as qoi_new_from_file() does,
+ * with its raster held in a memfd as for qoi_new_shared(). The file is mapped
+ * into memory and decoded from there, rather than being read into a buffer
+ * first. If the file is not valid, this returns NULL, and qoi_errno() can be
+ * used to find out why. The returned object should be freed using qoi_free()
+ * when no longer needed.
+ */
+Qoi *qoi_new_from_file_shared(
+		const char *filepath)
+{
+	int fd = open(filepath, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		qoi_error = QOI_ERROR_PERMISSIONS;
+		return NULL;
+	}
+
+	struct stat meta;
+	if (fstat(fd, &meta) == -1 || meta.st_size < QOI_HEADER_SIZE) {
+		qoi_error = QOI_ERROR_NOT_QOI_FILE;
+		close(fd);
+		return NULL;
+	}
+
+	/* The mapping stays valid once the descriptor is closed. */
+	size_t size = meta.st_size;
+	unsigned char *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		qoi_error = QOI_ERROR_MEMORY;
+		return NULL;
+	}
+
+	madvise(map, size, MADV_SEQUENTIAL);
+	Qoi *self = parse(map, size, 0, 1, NULL, NULL);
+	munmap(map, size);
+	return self;
+}
+
+/**
+ * Construct a new QOI object whose raster is the shared raster held in the
+ * memfd FD, as given by qoi_get_fd() in this or another process. Changes to
+ * the raster are seen by every object that shares it. FD remains owned by the
+ * caller and may be closed once this returns. FD must be sealed against
+ * shrinking, as the memfds made by this library are, so that the mapping
+ * cannot be cut short by another process. If FD does not hold a shared raster,
+ * this returns NULL, and qoi_errno() can be used to find out why. The returned
+ * object should be freed using qoi_free() when no longer needed.
+ */
+Qoi *qoi_new_from_fd(
+		int fd)
+{
+	/* Only a memfd sealed against shrinking can be mapped safely, as any
+	 * other could be cut short under the mapping by its other holders. The
+	 * seals are checked first, so that the size found next cannot change. */
+	int seals = fcntl(fd, F_GET_SEALS);
+	if (seals == -1 || !(seals & F_SEAL_SHRINK)) {
+		qoi_error = QOI_ERROR_NOT_QOI_FILE;
+		return NULL;
+	}
+
+	struct stat meta;
+	if (fstat(fd, &meta) == -1) {
+		qoi_error = QOI_ERROR_PERMISSIONS;
+		return NULL;
+	}
+
+	/* Ensure the memfd holds a shared raster, and is large enough for the
+	 * dimensions given in its header. */
+	unsigned char header[QOI_HEADER_SIZE];
+	size_t size;
+	if (meta.st_size < QOI_SHARED_HEADER_SIZE ||
+	    pread(fd, header, QOI_HEADER_SIZE, 0) != QOI_HEADER_SIZE ||
+	    memcmp(header, "qoim", 4) != 0 ||
+	    (header[12] != QOI_CHANNEL_RGB && header[12] != QOI_CHANNEL_RGBA) ||
+	    !raster_size(big_endian(header + 4), big_endian(header + 8), header[12], &size) ||
+	    size > (size_t) meta.st_size - QOI_SHARED_HEADER_SIZE) {
+
+		qoi_error = QOI_ERROR_NOT_QOI_FILE;
+		return NULL;
+	}
+
+	/* The object keeps its own descriptor, so that FD stays the caller's. */
+	int own = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+	if (own == -1) {
+		qoi_error = QOI_ERROR_MEMORY;
+		return NULL;
+	}
+
+	uint8_t *raster = map_shared(own, meta.st_size);
+	if (raster == NULL) {
+		close(own);
+	}
+
+	return qoi_new_from_data(
+			big_endian(header + 4),
+			big_endian(header + 8),
+			header[13],
+			header[12],
+			raster,
+			free_shared);
+}
+
+/**
+ * Returns the memfd holding the raster of SELF if it is shared, or -1 if it is
+ * not. The descriptor belongs to SELF and is closed by qoi_free(), so it
+ * should be duplicated if it is to outlive SELF, and it can be passed to
+ * another process over a Unix socket.
+ */
+int qoi_get_fd(
+		const Qoi *self)
+{
+	if (self->freer != free_shared) {
+		return -1;
+	}
+
+	return find_mapping(self->data)->fd;
+}
+
+/**
+ * Releases the resources held by a QOI object. Any buffers held by external
+ * resources after this call will be invalid.
+ */
+void qoi_free(
+		Qoi *self)
+{
+	if (self->freer != NULL) {
+		self->freer(self->data);
+	}
+
+	free(self);
+}
+
+/**
+ * Saves a QOI object to a .qoi file. On success returns 0, otherwise returns
+ * -1. qoi_errno() can be used to find out why a save operation failed.
+ */
+int qoi_save(
+		const Qoi *self,
+		const char *filepath)
+{
+	return save_file(self, filepath, 0, NULL, NULL, NULL);
+}
+
+/**
+ * Saves a QOI object to a .qoi file, as qoi_save() does, and finds its
+ * properties while encoding it, storing them in PROPERTIES unless it is NULL.
+ * If the image has an alpha channel but is opaque, the file is written with 3
+ * channels instead. The pixels are encoded the same either way, so this needs
+ * no second pass. On success returns 0, otherwise returns -1. qoi_errno() can
+ * be used to find out why a save operation failed.
+ */
+int qoi_save_reduced(
+		const Qoi *self,
+		const char *filepath,
+		QoiProperties *properties)
+{
+	QoiProperties found = 0;
+	int result = save_file(self, filepath, 0, NULL, NULL, &found);
+
+	if (properties != NULL) {
+		*properties = found;
+	}
+	return result;
+}
+
+/**
+ * Saves a QOI object to a .qoi file, as qoi_save() does, and computes the
+ * content hashes selected by TYPES into HASH while encoding. The hashes cost
+ * little extra, as each block of pixels is hashed just after it is encoded. On
+ * success returns 0, otherwise returns -1. qoi_errno() can be used to find out
+ * why a save operation failed.
+ */
+int qoi_save_hashed(
+		const Qoi *self,
+		const char *filepath,
+		QoiHashType types,
+		QoiHash *hash)
+{
+	hasher raster, encoded;
+	hasher_init(&raster);
+	hasher_init(&encoded);
+
+	int result = save_file(self,
+	                       filepath,
+	                       0,
+	                       types & QOI_HASH_RASTER ? &raster : NULL,
+	                       types & QOI_HASH_ENCODED ? &encoded : NULL,
+	                       NULL);
+
+	hash->raster = types & QOI_HASH_RASTER ? hasher_final(&raster) : 0;
+	hash->encoded = types & QOI_HASH_ENCODED ? hasher_final(&encoded) : 0;
+	return result;
+}
+
+/**
+ * Estimates the size in bytes of the .qoi file that qoi_save() would write for
+ * SELF, without encoding the whole image. A run of pixels is measured from
+ * each of several evenly spread parts of the raster, choosing operations as
+ * the encoder does, and the cost per pixel is averaged. If ERROR is not NULL,
+ * a bound on the error of the estimate is stored in it. The bound is
+ * statistical rather than certain: the true size is within that many bytes of
+ * the estimate for about 99 images in 100. Small images are measured in full,
+ * and the bound is then 0.
+ */
+uint64_t qoi_estimate_encoded_size(
+		const Qoi *self,
+		uint64_t *error)
+{
+	size_t pixels = (size_t) self->width * self->height;
+	uint64_t size = QOI_HEADER_SIZE + QOI_TRAILER_SIZE;
+	codec_state state;
+
+	/* Measure small images in full. */
+	if (pixels <= (size_t) 2 * QOI_ESTIMATE_SAMPLES * QOI_ESTIMATE_SAMPLE_PIXELS) {
+
+		codec_state_init(&state);
+		size += measure(&state, self->data, pixels, self->channels);
+
+		if (error != NULL) {
+			*error = 0;
+		}
+		return size;
+	}
+
+	/* Sample from a pseudo-random place in each part. Samples may start
+	 * anywhere in their part and run on into the next, so that every pixel is
+	 * equally likely to be sampled, even at the edges of the parts; otherwise
+	 * an image whose rows repeat at the same period as the parts is biased. */
+	uint64_t seed = 1;
+	double sum = 0, differences = 0, previous = 0, uncertainty = 0;
+
+	for (size_t i = 0; i < QOI_ESTIMATE_SAMPLES; i++) {
+		size_t first = i * pixels / QOI_ESTIMATE_SAMPLES;
+		size_t part = (i + 1) * pixels / QOI_ESTIMATE_SAMPLES - first;
+		seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+		size_t start = first + (seed >> 33) % part;
+
+		double cost = measure_sample(self, start, &uncertainty) / QOI_ESTIMATE_SAMPLE_PIXELS;
+		if (i > 0) {
+			differences += (cost - previous) * (cost - previous);
+		}
+
+		sum += cost;
+		previous = cost;
+	}
+
+	/* Each part is the same size, so the image's cost per pixel is the mean
+	 * of the samples. There is one sample per part, so the spread within
+	 * each part is estimated from the differences between neighbouring
+	 * samples, which does not count the differences between distant parts
+	 * of the image that the sampling already accounts for. */
+	double mean = sum / QOI_ESTIMATE_SAMPLES;
+	double variance = differences / (2 * (QOI_ESTIMATE_SAMPLES - 1));
+	double sampled = (double) QOI_ESTIMATE_SAMPLES * QOI_ESTIMATE_SAMPLE_PIXELS / pixels;
+	double deviation = square_root(variance / QOI_ESTIMATE_SAMPLES * (1 - sampled));
+
+	/* History too far back to follow leaves some of the codec state at the
+	 * start of the samples unknown, which can bias them in a way that their
+	 * spread does not show. The bias is at most the most that the unknown
+	 * state could have changed the samples by. */
+	double bias = uncertainty / ((double) QOI_ESTIMATE_SAMPLES * QOI_ESTIMATE_SAMPLE_PIXELS);
+
+	/* The extra byte allows for rounding. */
+	if (error != NULL) {
+		*error = (uint64_t) ((QOI_ESTIMATE_DEVIATIONS * deviation + bias) * pixels) + 1;
+	}
+	return size + (uint64_t) (mean * pixels + 0.5);
+}
+
+/**
+ * Saves a QOI object to a compressed QOI file. The QOI operations are
+ * compressed in blocks as they are encoded, which makes the file denser for
+ * images with repeated patterns. On success returns 0, otherwise returns -1.
+ * qoi_errno() can be used to find out why a save operation failed.
+ */
+int qoi_save_compressed(
+		const Qoi *self,
+		const char *filepath)
+{
+	return save_file(self, filepath, 1, NULL, NULL, NULL);
+}
+
+/**
+ * Construct a new QOI object from a compressed QOI file written by
+ * qoi_save_compressed(). The file is decompressed and decoded one block at a
+ * time. If the file is not valid, this returns NULL, and qoi_errno() can be
+ * used to find out why. The returned object should be freed using qoi_free()
+ * when no longer needed.
+ */
+Qoi *qoi_new_from_compressed_file(
+		const char *filepath)
+{
+	FILE *file = fopen(filepath, "rb");
+	if (file == NULL) {
+		qoi_error = QOI_ERROR_PERMISSIONS;
+		return NULL;
+	}
+
+	/* Read and check the header. */
+	unsigned char header[QOI_HEADER_SIZE];
+	if (fread(header, 1, QOI_HEADER_SIZE, file) < QOI_HEADER_SIZE ||
+	    memcmp(header, "qoiz", 4) != 0 ||
+	    (header[12] != QOI_CHANNEL_RGB && header[12] != QOI_CHANNEL_RGBA)) {
+
+		qoi_error = QOI_ERROR_NOT_QOI_FILE;
+		fclose(file);
+		return NULL;
+	}
+
+	Qoi *self = qoi_new(
+			big_endian(header + 4),
+			big_endian(header + 8),
+			header[13],
+			header[12]);
+
+	if (self == NULL) {
+		fclose(file);
+		return NULL;
+	}
+
+	qoi_error = decode_from_file(self, file);
+	fclose(file);
+
+	if (qoi_error != QOI_ERROR_NONE) {
+		qoi_free(self);
+		return NULL;
+	}
+
+	return self;
+}
+
+/**
+ * Appends a QOI object as a new frame at the end of a sequence file, creating
+ * the file if it does not exist. The frames already in the file are not
+ * rewritten; only the frame offsets that follow them are. If the frame cannot
+ * be appended, the file is put back as it was, or removed if this created it.
+ * On success returns 0, otherwise returns -1. qoi_errno() can be used to find
+ * out why the frame could not be appended, and is QOI_ERROR_FILE_CONTENT if
+ * the file could not be put back either.
+ */
+int qoi_sequence_append(
+		const Qoi *frame,
+		const char *filepath)
+{
+	uint32_t frame_count = 0;
+	uint64_t index_start = QOI_SEQUENCE_HEADER_SIZE;
+	unsigned char *index = NULL;
+	unsigned char footer[QOI_SEQUENCE_FOOTER_SIZE];
+	long size = 0;
+	char created = 0;
+	int error = QOI_ERROR_NONE;
+
+	FILE *file = fopen(filepath, "r+b");
+	if (file == NULL && errno == ENOENT) {
+		/* Start a new sequence. */
+		file = fopen(filepath, "w+b");
+		created = 1;
+		if (file != NULL && fwrite("qois", 1, QOI_SEQUENCE_HEADER_SIZE, file) < QOI_SEQUENCE_HEADER_SIZE) {
+			error = QOI_ERROR_DISK_SPACE;
+		}
+	} else if (file != NULL) {
+		/* Read the footer and the frame offsets before they are overwritten. */
+		if (fseek(file, 0, SEEK_END) != 0 ||
+		    (size = ftell(file)) < QOI_SEQUENCE_HEADER_SIZE + QOI_SEQUENCE_FOOTER_SIZE ||
+		    fseek(file, size - QOI_SEQUENCE_FOOTER_SIZE, SEEK_SET) != 0 ||
+		    fread(footer, 1, QOI_SEQUENCE_FOOTER_SIZE, file) < QOI_SEQUENCE_FOOTER_SIZE ||
+		    memcmp(footer + 4, "qsix", 4) != 0) {
+
+			error = QOI_ERROR_NOT_QOI_FILE;
+		} else {
+			frame_count = big_endian(footer);
+			index_start = size - QOI_SEQUENCE_FOOTER_SIZE - (uint64_t) frame_count * 8;
+			index = malloc((size_t) frame_count * 8 + 8);
+
+			if (index == NULL) {
+				error = QOI_ERROR_MEMORY;
+			} else if (index_start < QOI_SEQUENCE_HEADER_SIZE ||
+			           index_start > (uint64_t) size ||
+			           fseek(file, index_start, SEEK_SET) != 0 ||
+			           fread(index, 1, (size_t) frame_count * 8, file) < (size_t) frame_count * 8) {
+
+				error = QOI_ERROR_FILE_CONTENT;
+			}
+		}
+	}
+
+	if (file == NULL) {
+		qoi_error = QOI_ERROR_PERMISSIONS;
+		return -1;
+	}
+
+	if (error == QOI_ERROR_NONE && index == NULL) {
+		index = malloc(8);
+		if (index == NULL) {
+			error = QOI_ERROR_MEMORY;
+		}
+	}
+
+	/* Write the new frame over the old offsets, then the offsets after it. */
+	if (error == QOI_ERROR_NONE && fseek(file, index_start, SEEK_SET) != 0) {
+		error = QOI_ERROR_FILE_CONTENT;
+	}
+
+	/* From here on, a failure leaves the file to be put back as it was. */
+	char writing = error == QOI_ERROR_NONE;
+	uint64_t write_time = 0;
+	if (writing) {
+		error = write_file(frame, file, 0, &write_time, NULL, NULL, NULL);
+	}
+
+	if (error == QOI_ERROR_NONE) {
+		char new_footer[QOI_SEQUENCE_FOOTER_SIZE];
+		big_endian64_r((char*) index + (size_t) frame_count * 8, index_start);
+		big_endian_r(new_footer, frame_count + 1);
+		memcpy(new_footer + 4, "qsix", 4);
+
+		if (fwrite(index, 1, (size_t) (frame_count + 1) * 8, file) < (size_t) (frame_count + 1) * 8 ||
+		    fwrite(new_footer, 1, QOI_SEQUENCE_FOOTER_SIZE, file) < QOI_SEQUENCE_FOOTER_SIZE) {
+
+			error = QOI_ERROR_DISK_SPACE;
+		}
+	}
+
+	/* The descriptor is kept past fclose(), so that the file can be put back
+	 * without anything left in the stream's buffer being written after it. */
+	int fd = writing && error != QOI_ERROR_NONE && !created ? dup(fileno(file)) : -1;
+	long end = ftell(file);
+
+	/* Writing the offsets and closing the file are timed as writing. */
+	tracer trace;
+	tracer_init(&trace);
+	uint64_t start = tracer_clock(&trace);
+	if (fclose(file) != 0 && error == QOI_ERROR_NONE) {
+		error = QOI_ERROR_DISK_SPACE;
+	}
+	write_time += tracer_clock(&trace) - start;
+
+	/* A new sequence is removed, however far it got. Otherwise put the old
+	 * offsets and footer back over the failed frame, and cut off whatever of
+	 * it was written past them. If that fails too, the sequence is damaged. */
+	if (error != QOI_ERROR_NONE && created) {
+		unlink(filepath);
+	} else if (error != QOI_ERROR_NONE && writing) {
+		size_t index_size = (size_t) frame_count * 8;
+		if (fd == -1 ||
+		    pwrite(fd, index, index_size, index_start) != (ssize_t) index_size ||
+		    pwrite(fd, footer, QOI_SEQUENCE_FOOTER_SIZE, index_start + index_size) !=
+		    QOI_SEQUENCE_FOOTER_SIZE ||
+		    ftruncate(fd, size) != 0) {
+
+			error = QOI_ERROR_FILE_CONTENT;
+		}
+	}
+	if (fd != -1) {
+		close(fd);
+	}
+	free(index);
+
+	if (error != QOI_ERROR_NONE) {
+		qoi_error = error;
+		return -1;
+	}
+
+	tracer_report(&trace, QOI_PHASE_WRITE, write_time, end - index_start, 0);
+	return 0;
+}
+
+/**
+ * Opens a sequence file by mapping it into memory. Frames are only read from
+ * the file when they are decoded. Frames may be appended to the file with
+ * qoi_sequence_append() while it is open; the sequence keeps the frames it was
+ * opened with, and must be opened again to see the new ones. The file must not
+ * be changed in any other way while it is open. If the file is not valid, this
+ * returns NULL, and qoi_errno() can be used to find out why. The returned
+ * sequence should be freed using qoi_sequence_free() when no longer needed.
+ */
+QoiSequence *qoi_sequence_open(
+		const char *filepath)
+{
+	int fd = open(filepath, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		qoi_error = QOI_ERROR_PERMISSIONS;
+		return NULL;
+	}
+
+	struct stat meta;
+	if (fstat(fd, &meta) == -1 ||
+	    meta.st_size < QOI_SEQUENCE_HEADER_SIZE + QOI_SEQUENCE_FOOTER_SIZE) {
+
+		qoi_error = QOI_ERROR_NOT_QOI_FILE;
+		close(fd);
+		return NULL;
+	}
+
+	/* The mapping stays valid once the descriptor is closed. */
+	size_t size = meta.st_size;
+	unsigned char *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		qoi_error = QOI_ERROR_MEMORY;
+		return NULL;
+	}
+
+	QoiSequence *self = malloc(sizeof(QoiSequence));
+	if (self == NULL) {
+		qoi_error = QOI_ERROR_MEMORY;
+		munmap(map, size);
+		return NULL;
+	}
+
+	self->map = map;
+	self->size = size;
+	self->frame_count = big_endian(map + size - QOI_SEQUENCE_FOOTER_SIZE);
+	self->index = NULL;
+	self->prefetch = 0;
+
+	/* Ensure the file is a sequence, and its frames lie in order within it,
+	 * so that they can be decoded without further checks. */
+	uint64_t index_size = (uint64_t) self->frame_count * 8;
+	if (memcmp(map, "qois", 4) != 0 ||
+	    memcmp(map + size - 4, "qsix", 4) != 0 ||
+	    index_size > size - QOI_SEQUENCE_HEADER_SIZE - QOI_SEQUENCE_FOOTER_SIZE) {
+
+		qoi_error = QOI_ERROR_NOT_QOI_FILE;
+		qoi_sequence_free(self);
+		return NULL;
+	}
+
+	/* The offsets are copied, as they are overwritten in the file by the
+	 * next frame appended to it, while the frames themselves are not. */
+	self->index_start = size - QOI_SEQUENCE_FOOTER_SIZE - index_size;
+	self->index = malloc(index_size + 1);
+	if (self->index == NULL) {
+		qoi_error = QOI_ERROR_MEMORY;
+		qoi_sequence_free(self);
+		return NULL;
+	}
+	memcpy(self->index, map + self->index_start, index_size);
+
+	for (uint32_t i = 0; i < self->frame_count; i++) {
+		uint64_t start = frame_offset(self, i);
+		if (start < QOI_SEQUENCE_HEADER_SIZE || start > frame_offset(self, i + 1)) {
+			qoi_error = QOI_ERROR_FILE_CONTENT;
+			qoi_sequence_free(self);
+			return NULL;
+		}
+	}
+
+	return self;
+}
+
+/**
+ * Returns the number of frames in the sequence.
+ */
+uint32_t qoi_sequence_get_frame_count(
+		const QoiSequence *self)
+{
+	return self->frame_count;
+}
+
+/**
+ * Sets the number of frames after each decoded frame that are read ahead from
+ * the file in the background, for smooth playback. A FRAMES of 0, the default,
+ * turns reading ahead off.
+ */
+void qoi_sequence_set_prefetch(
+		QoiSequence *self,
+		uint32_t frames)
+{
+	self->prefetch = frames;
+}
+
+/**
+ * Construct a new QOI object by decoding the frame at INDEX of the sequence,
+ * straight from the mapped file. If the frame is not valid or does not exist,
+ * this returns NULL, and qoi_errno() can be used to find out why. The returned
+ * object should be freed using qoi_free() when no longer needed.
+ */
+Qoi *qoi_sequence_get_frame(
+		const QoiSequence *self,
+		uint32_t index)
+{
+	if (index >= self->frame_count) {
+		qoi_error = QOI_ERROR_OUT_OF_RANGE;
+		return NULL;
+	}
+
+	uint64_t start = frame_offset(self, index);
+	uint64_t end = frame_offset(self, index + 1);
+
+	/* Ask for the upcoming frames to be read in while this one decodes. */
+	if (self->prefetch != 0 && index + 1 < self->frame_count) {
+		uint32_t last = index + MIN(self->prefetch, self->frame_count - index - 1);
+		uint64_t page = sysconf(_SC_PAGESIZE);
+		uint64_t ahead = end & ~(page - 1);
+		madvise(self->map + ahead, frame_offset(self, last + 1) - ahead, MADV_WILLNEED);
+	}
+
+	return parse(self->map + start, end - start, 0, 0, NULL, NULL);
+}
+
+/**
+ * Unmaps the sequence file and releases the resources held by the sequence.
+ * Objects decoded from it remain valid.
+ */
+void qoi_sequence_free(
+		QoiSequence *self)
+{
+	munmap(self->map, self->size);
+	free(self->index);
+	free(self);
+}
+
+/**
+ * Construct a new QOI object from a chunked QOI file written by
+ * qoi_save_chunked(). The strips of the file are decoded in parallel. If the
+ * file is not valid, this returns NULL, and qoi_errno() can be used to find
+ * out why. The returned object should be freed using qoi_free() when no longer
+ * needed.
+ */
+Qoi *qoi_new_from_chunked_file(
+		const char *filepath)
+{
+	size_t size;
+	unsigned char *file_buffer = read_file(filepath, &size);
+	if (file_buffer == NULL) {
+		return NULL;
+	}
+
+	/* Ensure the file is a chunked QOI file. */
+	if (size < QOI_CHUNKED_HEADER_SIZE || memcmp(file_buffer, "qoic", 4) != 0) {
+		qoi_error = QOI_ERROR_NOT_QOI_FILE;
+		free(file_buffer);
+		return NULL;
+	}
+
+	uint32_t width = big_endian(file_buffer + 4);
+	uint32_t height = big_endian(file_buffer + 8);
+	QoiChannel channels = file_buffer[12];
+	QoiColorspace colorspace = file_buffer[13];
+	uint32_t strip_height = big_endian(file_buffer + 14);
+	size_t strips = strip_count(height, strip_height);
+
+	if ((channels != QOI_CHANNEL_RGB && channels != QOI_CHANNEL_RGBA) ||
+	    (height > 0 && strip_height == 0)) {
+
+		qoi_error = QOI_ERROR_NOT_QOI_FILE;
+		free(file_buffer);
+		return NULL;
+	}
+
+	/* Ensure the strip table is complete and every strip lies within the
+	 * file, so that the strips can be decoded without further checks. */
+	const unsigned char *offsets = file_buffer + QOI_CHUNKED_HEADER_SIZE;
+	size_t table_end = QOI_CHUNKED_HEADER_SIZE + (strips + 1) * 8;
+	if (table_end > size) {
+		qoi_error = QOI_ERROR_FILE_CONTENT;
+		free(file_buffer);
+		return NULL;
+	}
+
+	for (size_t i = 0; i <= strips; i++) {
+		uint64_t offset = big_endian64(offsets + i * 8);
+		if (offset < table_end ||
+		    offset > size ||
+		    (i > 0 && offset < big_endian64(offsets + (i - 1) * 8))) {
+
+			qoi_error = QOI_ERROR_FILE_CONTENT;
+			free(file_buffer);
+			return NULL;
+		}
+	}
+
+	Qoi *self = qoi_new(width, height, colorspace, channels);
+	if (self == NULL) {
+		free(file_buffer);
+		return NULL;
+	}
+
+	/* Decode the strips straight into the raster. */
+	chunked_job job = {
+		.image = self,
+		.strip_height = strip_height,
+		.input = file_buffer,
+		.offsets = offsets,
+		.error = QOI_ERROR_NONE
+	};
+	run_parallel(decode_strip, &job, strips);
+	free(file_buffer);
+
+	if (job.error != QOI_ERROR_NONE) {
+		qoi_error = job.error;
+		qoi_free(self);
+		return NULL;
+	}
+
+	return self;
+}
+
+/**
+ * Construct a new QOI object from the strip at INDEX of a chunked QOI file,
+ * without reading the rest of the file. The object is as wide as the image
+ * and as tall as the strip. If the file is not valid or has no such strip,
+ * this returns NULL, and qoi_errno() can be used to find out why. The returned
+ * object should be freed using qoi_free() when no longer needed.
+ */
+Qoi *qoi_new_from_chunked_file_strip(
+		const char *filepath,
+		uint32_t index)
+{
+	FILE *file = fopen(filepath, "rb");
+	if (file == NULL) {
+		qoi_error = QOI_ERROR_PERMISSIONS;
+		return NULL;
+	}
+
+	/* Read and check the header. */
+	unsigned char header[QOI_CHUNKED_HEADER_SIZE];
+	if (fread(header, 1, QOI_CHUNKED_HEADER_SIZE, file) < QOI_CHUNKED_HEADER_SIZE ||
+	    memcmp(header, "qoic", 4) != 0) {
+
+		qoi_error = QOI_ERROR_NOT_QOI_FILE;
+		fclose(file);
+		return NULL;
+	}
+
+	uint32_t width = big_endian(header + 4);
+	uint32_t height = big_endian(header + 8);
+	QoiChannel channels = header[12];
+	QoiColorspace colorspace = header[13];
+	uint32_t strip_height = big_endian(header + 14);
+
+	if (channels != QOI_CHANNEL_RGB && channels != QOI_CHANNEL_RGBA) {
+		qoi_error = QOI_ERROR_NOT_QOI_FILE;
+		fclose(file);
+		return NULL;
+	}
+
+	if (index >= strip_count(height, strip_height)) {
+		qoi_error = QOI_ERROR_OUT_OF_RANGE;
+		fclose(file);
+		return NULL;
+	}
+
+	/* Read the two table entries bounding the strip. */
+	unsigned char bounds[16];
+	if (fseek(file, QOI_CHUNKED_HEADER_SIZE + (long) index * 8, SEEK_SET) != 0 ||
+	    fread(bounds, 1, 16, file) < 16) {
+
+		qoi_error = QOI_ERROR_FILE_CONTENT;
+		fclose(file);
+		return NULL;
+	}
+
+	uint64_t start = big_endian64(bounds);
+	uint64_t end = big_endian64(bounds + 8);
+	if (end < start) {
+		qoi_error = QOI_ERROR_FILE_CONTENT;
+		fclose(file);
+		return NULL;
+	}
+
+	/* Read the strip itself. */
+	size_t size = end - start;
+	unsigned char *strip = malloc(size + 1);
+	if (strip == NULL) {
+		qoi_error = QOI_ERROR_MEMORY;
+		fclose(file);
+		return NULL;
+	}
+
+	if (fseek(file, start, SEEK_SET) != 0 || fread(strip, 1, size, file) < size) {
+		qoi_error = QOI_ERROR_FILE_CONTENT;
+		free(strip);
+		fclose(file);
+		return NULL;
+	}
+	fclose(file);
+
+	uint32_t rows = MIN(strip_height, height - index * strip_height);
+	Qoi *self = qoi_new(width, rows, colorspace, channels);
+	if (self == NULL) {
+		free(strip);
+		return NULL;
+	}
+
+	codec_state state;
+	codec_state_init(&state);
+	if (decode(&state, strip, size, self->data, (size_t) width * rows, channels) == -1) {
+		qoi_error = QOI_ERROR_FILE_CONTENT;
+		free(strip);
+		qoi_free(self);
+		return NULL;
+	}
+
+	free(strip);
+	return self;
+}
+
+/**
+ * Saves a QOI object to a chunked QOI file. The image is split into strips of
+ * STRIP_HEIGHT rows, which are encoded independently and in parallel so that
+ * they can later be decoded in parallel or one at a time. If STRIP_HEIGHT is
+ * 0, strips of around 64K pixels are used. On success returns 0, otherwise
+ * returns -1. qoi_errno() can be used to find out why a save operation failed.
+ */
+int qoi_save_chunked(
+		const Qoi *self,
+		const char *filepath,
+		uint32_t strip_height)
+{
+	if (strip_height == 0) {
+		strip_height = self->width >= QOI_DEFAULT_STRIP_PIXELS ? 1 :
+			QOI_DEFAULT_STRIP_PIXELS / (self->width + 1) + 1;
+	}
+	size_t strips = strip_count(self->height, strip_height);
+
+	/* Encode every strip into its own buffer. */
+	chunked_job job = {
+		.image = self,
+		.strip_height = strip_height,
+		.strips = calloc(strips + 1, sizeof(unsigned char*)),
+		.sizes = calloc(strips + 1, sizeof(size_t)),
+		.error = QOI_ERROR_NONE
+	};
+
+	if (job.strips == NULL || job.sizes == NULL) {
+		qoi_error = QOI_ERROR_MEMORY;
+		free(job.strips);
+		free(job.sizes);
+		return -1;
+	}
+
+	run_parallel(encode_strip, &job, strips);
+
+	/* Write the header, strip table, and strips. */
+	FILE *file = NULL;
+	if (job.error == QOI_ERROR_NONE) {
+		file = fopen(filepath, "wb");
+		if (file == NULL) {
+			job.error = QOI_ERROR_PERMISSIONS;
+		}
+	}
+
+	if (job.error == QOI_ERROR_NONE) {
+		char header[QOI_CHUNKED_HEADER_SIZE];
+		make_header(self, "qoic", header);
+		big_endian_r(header + QOI_HEADER_SIZE, strip_height);
+		if (fwrite(header, 1, QOI_CHUNKED_HEADER_SIZE, file) < QOI_CHUNKED_HEADER_SIZE) {
+			job.error = QOI_ERROR_DISK_SPACE;
+		}
+
+		uint64_t offset = QOI_CHUNKED_HEADER_SIZE + (strips + 1) * 8;
+		for (size_t i = 0; i <= strips && job.error == QOI_ERROR_NONE; i++) {
+			char entry[8];
+			big_endian64_r(entry, offset);
+			if (fwrite(entry, 1, 8, file) < 8) {
+				job.error = QOI_ERROR_DISK_SPACE;
+			}
+			offset += job.sizes[i];
+		}
+
+		for (size_t i = 0; i < strips && job.error == QOI_ERROR_NONE; i++) {
+			if (fwrite(job.strips[i], 1, job.sizes[i], file) < job.sizes[i]) {
+				job.error = QOI_ERROR_DISK_SPACE;
+			}
+		}
+	}
+
+	if (file != NULL && fclose(file) != 0 && job.error == QOI_ERROR_NONE) {
+		job.error = QOI_ERROR_DISK_SPACE;
+	}
+
+	for (size_t i = 0; i < strips; i++) {
+		free(job.strips[i]);
+	}
+	free(job.strips);
+	free(job.sizes);
+
+	if (job.error != QOI_ERROR_NONE) {
+		qoi_error = job.error;
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Converts the .qoi file at QOI_FILEPATH into a chunked QOI file at
+ * CHUNKED_FILEPATH, using strips of STRIP_HEIGHT rows as qoi_save_chunked()
+ * does. On success returns 0, otherwise returns -1. qoi_errno() can be used to
+ * find out why the conversion failed.
+ */
+int qoi_convert_to_chunked(
+		const char *qoi_filepath,
+		const char *chunked_filepath,
+		uint32_t strip_height)
+{
+	Qoi *image = qoi_new_from_file(qoi_filepath);
+	if (image == NULL) {
+		return -1;
+	}
+
+	int result = qoi_save_chunked(image, chunked_filepath, strip_height);
+	qoi_free(image);
+	return result;
+}
+
+/**
+ * Converts the chunked QOI file at CHUNKED_FILEPATH into a .qoi file at
+ * QOI_FILEPATH. On success returns 0, otherwise returns -1. qoi_errno() can be
+ * used to find out why the conversion failed.
+ */
+int qoi_convert_from_chunked(
+		const char *chunked_filepath,
+		const char *qoi_filepath)
+{
+	Qoi *image = qoi_new_from_chunked_file(chunked_filepath);
+	if (image == NULL) {
+		return -1;
+	}
+
+	int result = qoi_save(image, qoi_filepath);
+	qoi_free(image);
+	return result;
+}
+
+/**
+ * Begins loading a QOI object from a QOI file in the background, and returns
+ * immediately. The file is read by one of a fixed number of I/O threads, and
+ * is then decoded by one of a thread per processor, so that other reads stay
+ * in flight while it decodes. When the load finishes, CALLBACK (which may be
+ * NULL) is called from a background thread with the operation and USERDATA;
+ * it should return promptly, and must not wait on other operations. The
+ * loaded object is retrieved with qoi_async_get_result(). If the operation
+ * could not be started, this returns NULL, and qoi_errno() can be used to find
+ * out why. The returned operation should be freed using qoi_async_free().
+ */
+QoiAsync *qoi_new_from_file_async(
+		const char *filepath,
+		void (*callback)(QoiAsync*, void*),
+		void *userdata)
+{
+	return async_start(filepath, NULL, &io_pool, async_read, callback, userdata);
+}
+
+/**
+ * Begins saving a QOI object to a .qoi file in the background, and returns
+ * immediately. The image is encoded into memory by one of a thread per
+ * processor, and then written by one of the I/O threads. SELF must not be
+ * freed or changed until the operation has finished. CALLBACK, USERDATA, and
+ * the return value behave as they do for qoi_new_from_file_async().
+ */
+QoiAsync *qoi_save_async(
+		const Qoi *self,
+		const char *filepath,
+		void (*callback)(QoiAsync*, void*),
+		void *userdata)
+{
+	return async_start(filepath, self, &codec_pool, async_encode, callback, userdata);
+}
+
+/**
+ * Returns a file descriptor that becomes readable once the operation has
+ * finished, so that it can be waited upon with poll() or an event loop. The
+ * descriptor belongs to the operation and should not be closed or read.
+ */
+int qoi_async_get_fd(
+		const QoiAsync *op)
+{
+	return op->fd;
+}
+
+/**
+ * Returns 1 if the operation has finished, and 0 if it is still running.
+ */
+int qoi_async_is_done(
+		const QoiAsync *op)
+{
+	struct pollfd pfd = { .fd = op->fd, .events = POLLIN };
+	return poll(&pfd, 1, 0) == 1;
+}
+
+/**
+ * Blocks until the operation has finished. On success returns 0, otherwise
+ * returns -1, and qoi_async_errno() can be used to find out why. This must not
+ * be called from the operation's own callback.
+ */
+int qoi_async_wait(
+		QoiAsync *op)
+{
+	pthread_mutex_lock(&op->lock);
+	while (!op->finished) {
+		pthread_cond_wait(&op->done, &op->lock);
+	}
+	pthread_mutex_unlock(&op->lock);
+
+	return op->error == QOI_ERROR_NONE ? 0 : -1;
+}
+
+/**
+ * Returns the error code of a finished operation, which is QOI_ERROR_NONE (0)
+ * if it succeeded.
+ */
+int qoi_async_errno(
+		const QoiAsync *op)
+{
+	return op->error;
+}
+
+/**
+ * Returns the object loaded by a finished qoi_new_from_file_async(), or NULL
+ * if the load failed or the operation was a save. The object belongs to the
+ * caller, and should be freed using qoi_free() when no longer needed.
+ */
+Qoi *qoi_async_get_result(
+		const QoiAsync *op)
+{
+	return op->result;
+}
+
+/**
+ * Waits for the operation to finish and releases the resources held by it.
+ * This must not be called from the operation's own callback.
+ */
+void qoi_async_free(
+		QoiAsync *op)
+{
+	qoi_async_wait(op);
+	pthread_mutex_destroy(&op->lock);
+	pthread_cond_destroy(&op->done);
+	close(op->fd);
+	free(op->filepath);
+	free(op);
+}
+
+/**
+ * Gets the image buffer. Each pixel is represented with either 24 or 32 bits,
+ * depending on if the Qoi object is set to QOI_CHANNEL_RGB or QOI_CHANNEL_RGBA
+ * respectively. Keep in mind that this is the actual image buffer, and changing
+ * values in this will result in the image being changed. Do not free this
+ * buffer.
+ */
+uint8_t *qoi_get_raster(
+		const Qoi *self)
+{
+	return self->data;
+}
+
+/**
+ * Gets a copy of the image buffer. Each pixel is represented with either 32 or
+ * 24 bits, depending on if the Qoi image has an alpha channel or not,
+ * respectively. This buffer may be changed without changing the Qoi image
+ * itself. The returned value should be freed using free() when no longer
+ * needed.
+ */
+uint8_t *qoi_get_raster_clone(
+		const Qoi *self)
+{
+	size_t size = self->width * self->height * self->channels;
+	uint8_t *clone = malloc(size);
+	memcpy(clone, self->data, size);
+	return clone;
+}
+
+/**
+ * Returns the error code for the previous failure. A string representation
+ * of this code can be acquired via qoi_strerror().
+ */
+int qoi_errno()
+{
+	return qoi_error;
+}
+
+/**
+ * Returns a string representation of the given error code. The returned string
+ * is statically allocated and should NOT be freed.
+ */
+const char *qoi_strerror(
+		int error_code)
+{
+	if (error_code < 0 || error_code >= QOI_INVALID_ERROR_CODE) {
+		return qoi_strerror_messages[QOI_INVALID_ERROR_CODE];
+	}
+
+	return qoi_strerror_messages[error_code];
+}
+
+/**
+ * Sets a function to be called with the time taken by each phase of every
+ * load and save, in nanoseconds, and the number of bytes and pixels handled
+ * by it. Each phase is reported once, with its total time, even when it is
+ * done a block at a time.
+ * CALLBACK is called from the thread doing the load or save, with USERDATA.
+ * Passing NULL removes the callback, after which nothing is timed. This should
+ * be called before any loads or saves are started on other threads.
+ */
+void qoi_set_trace_callback(
+		void (*callback)(QoiPhase, uint64_t, uint64_t, uint64_t, void*),
+		void *userdata)
+{
+	atomic_store(&trace_userdata, userdata);
+	atomic_store(&trace_callback, callback);
+}
+
+/**
+ * Returns the properties of the Qoi image, found by scanning its raster.
+ */
+QoiProperties qoi_get_properties(
+		const Qoi *self)
+{
+	return scan(self->data, (size_t) self->width * self->height, self->channels);
+}
+
+/**
+ * Returns 1 if the Qoi image has an alpha channel, and 0 if it does not.
+ */
+int qoi_has_alpha(
+		const Qoi *self)
+{
+	return self->channels == QOI_CHANNEL_RGBA;
+}
+
+/**
+ * Returns the width (in pixels) of this image.
+ */
+int qoi_get_width(
+		const Qoi *self)
+{
+	return self->width;
+}
+
+/**
+ * Returns the height (in pixels) of this image.
+ */
+int qoi_get_height(
+		const Qoi *self)
+{
+	return self->height;
+}
+
+/**
+ * Returns the number of bytes between the start of subsequent pixel rows, in
+ * the raster. This will always be equal to the width times 3 or 4 (3 if an
+ * alpha channel does not exist, and 4 if it does).
+ */
+int qoi_get_rowstride(
+		const Qoi *self)
+{
+	return self->width * self->channels;
+}
+
+/**
+ * Converts the given four bytes into a 32 bit number by interpreting the bytes
+ * as big endian.
+ */
+static uint32_t big_endian(
+		const unsigned char *raw)
+{
+	return ((uint32_t) raw[0] << 24) | (raw[1] << 16) | (raw[2] << 8)  | raw[3];
+}
+
+/**
+ * Stores the 32 bit numerical INPUT into a big endian array OUTPUT.
+ */
+static void big_endian_r(
+		char *output,
+		const uint32_t input)
+{
+	output[0] = (input & 0xFF000000) >> 24;
+	output[1] = (input & 0xFF0000) >> 16;
+	output[2] = (input & 0xFF00) >> 8;
+	output[3] = input & 0xFF;
+}
+
+/**
+ * Converts the given eight bytes into a 64 bit number by interpreting the
+ * bytes as big endian.
+ */
+static uint64_t big_endian64(
+		const unsigned char *raw)
+{
+	return ((uint64_t) big_endian(raw) << 32) | big_endian(raw + 4);
+}
+
+/**
+ * Stores the 64 bit numerical INPUT into a big endian array OUTPUT.
+ */
+static void big_endian64_r(
+		char *output,
+		const uint64_t input)
+{
+	big_endian_r(output, input >> 32);
+	big_endian_r(output + 4, input & 0xFFFFFFFF);
+}
+
+/**
+ * Retrieves the size in bytes of the file given by the FILEPATH.
+ */
+static ssize_t filesize(
+		const char *filepath)
+{
+	struct stat meta;
+	if (stat(filepath, &meta) == -1) {
+		return -1;
+	}
+
+	return meta.st_size;
+}
+
+/**
+ * Reads the whole of the file given by the FILEPATH into a newly allocated
+ * buffer, and stores its size in SIZE. Returns NULL on failure, with qoi_error
+ * set to indicate why.
+ */
+static unsigned char *read_file(
+		const char *filepath,
+		size_t *size)
+{
+	tracer trace;
+	tracer_init(&trace);
+
+	/* Get the size of the input file. */
+	QOI_PROBE(stat_start, filepath);
+	uint64_t start = tracer_clock(&trace);
+	ssize_t file_size = filesize(filepath);
+	if (file_size == -1) {
+		qoi_error = QOI_ERROR_PERMISSIONS;
+		return NULL;
+	}
+
+	QOI_PROBE(stat_done, filepath, file_size);
+	tracer_report(&trace, QOI_PHASE_STAT, tracer_clock(&trace) - start, file_size, 0);
+
+	/* Allocate space for the file content. */
+	unsigned char *file_buffer = malloc(file_size + 1);
+	if (file_buffer == NULL) {
+		qoi_error = QOI_ERROR_MEMORY;
+		return NULL;
+	}
+
+	/* Open the file. */
+	QOI_PROBE(read_start, file_size);
+	start = tracer_clock(&trace);
+	FILE *file = fopen(filepath, "rb");
+	if (file == NULL) {
+		qoi_error = QOI_ERROR_PERMISSIONS;
+		free(file_buffer);
+		return NULL;
+	}
+
+	/* Read the whole file. */
+	size_t bytes_read = fread(file_buffer, 1, file_size, file);
+	fclose(file);
+	if (bytes_read != (size_t) file_size) {
+		qoi_error = QOI_ERROR_FILE_CONTENT;
+		free(file_buffer);
+		return NULL;
+	}
+
+	QOI_PROBE(read_done, file_size);
+	tracer_report(&trace, QOI_PHASE_READ, tracer_clock(&trace) - start, file_size, 0);
+
+	*size = file_size;
+	return file_buffer;
+}
+
+/**
+ * Stores the size in bytes of the raster of an image with the given
+ * dimensions in SIZE. Returns 0 if the raster is too large, and 1 otherwise.
+ */
+static int raster_size(
+		const uint32_t width,
+		const uint32_t height,
+		const QoiChannel channels,
+		size_t *size)
+{
+	size_t pixels = (size_t) width * height;
+	if (height != 0 && pixels / height != width) {
+		return 0;
+	}
+
+	if (pixels > SIZE_MAX / 4) {
+		return 0;
+	}
+
+	*size = pixels * channels;
+	return 1;
+}
+
+/**
+ * Allocates a raster for an image with the given dimensions. Returns NULL if
+ * the raster is too large or cannot be allocated.
+ */
+static uint8_t *allocate_raster(
+		const uint32_t width,
+		const uint32_t height,
+		const QoiChannel channels)
+{
+	size_t size;
+	if (!raster_size(width, height, channels, &size)) {
+		return NULL;
+	}
+
+	/* Always allocate at least one byte, so that empty images are valid. */
+	return malloc(size + 1);
+}
+
+/**
+ * Allocates a raster for an image with the given specifications in a new
+ * memfd, after a header that describes it. Returns NULL if the raster is too
+ * large or cannot be allocated. The raster should be freed using
+ * free_shared().
+ */
+static uint8_t *allocate_shared_raster(
+		const uint32_t width,
+		const uint32_t height,
+		const QoiColorspace colorspace,
+		const QoiChannel channels)
+{
+	size_t size;
+	if (!raster_size(width, height, channels, &size) ||
+	    size > SIZE_MAX - QOI_SHARED_HEADER_SIZE) {
+
+		return NULL;
+	}
+
+	int fd = memfd_create("qoi", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (fd == -1) {
+		return NULL;
+	}
+
+	/* Seal the size, so that a process the raster is handed to can map it
+	 * without the risk of it being truncated underneath. */
+	size += QOI_SHARED_HEADER_SIZE;
+	if (ftruncate(fd, size) == -1 ||
+	    fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) == -1) {
+
+		close(fd);
+		return NULL;
+	}
+
+	uint8_t *raster = map_shared(fd, size);
+	if (raster == NULL) {
+		close(fd);
+		return NULL;
+	}
+
+	char *header = (char*) raster - QOI_SHARED_HEADER_SIZE;
+	memcpy(header, "qoim", 4);
+	big_endian_r(header + 4, width);
+	big_endian_r(header + 8, height);
+	header[12] = channels;
+	header[13] = colorspace;
+	return raster;
+}
+
+/**
+ * Maps the SIZE bytes of the memfd FD, which holds a shared raster after its
+ * header, and makes the mapping the owner of FD. Returns the raster, or NULL
+ * on failure.
+ */
+static uint8_t *map_shared(
+		const int fd,
+		const size_t size)
+{
+	/* Reserve a private page for the mapping information, followed by room
+	 * for the memfd. The page is private so that each process that maps the
+	 * raster keeps its own. */
+	size_t page = sysconf(_SC_PAGESIZE);
+	uint8_t *base = mmap(NULL,
+	                     page + size,
+	                     PROT_READ | PROT_WRITE,
+	                     MAP_PRIVATE | MAP_ANONYMOUS,
+	                     -1,
+	                     0);
+
+	if (base == MAP_FAILED) {
+		return NULL;
+	}
+
+	if (mmap(base + page,
+	         size,
+	         PROT_READ | PROT_WRITE,
+	         MAP_SHARED | MAP_FIXED,
+	         fd,
+	         0) == MAP_FAILED) {
+
+		munmap(base, page + size);
+		return NULL;
+	}
+
+	shared_mapping *mapping = (shared_mapping*) base;
+	mapping->fd = fd;
+	mapping->size = page + size;
+	return base + page + QOI_SHARED_HEADER_SIZE;
+}
+
+/**
+ * Returns the information kept before the shared raster RASTER.
+ */
+static shared_mapping *find_mapping(
+		const void *raster)
+{
+	size_t page = sysconf(_SC_PAGESIZE);
+	return (shared_mapping*) ((uint8_t*) raster - QOI_SHARED_HEADER_SIZE - page);
+}
+
+/**
+ * Unmaps a shared raster, and closes its memfd.
+ */
+static void free_shared(
+		void *raster)
+{
+	shared_mapping *mapping = find_mapping(raster);
+	int fd = mapping->fd;
+	munmap(mapping, mapping->size);
+	close(fd);
+}
+
+/**
+ * Constructs a new QOI object from the SIZE bytes of QOI file data in INPUT.
+ * The raster has CHANNELS channels, or those of the file if CHANNELS is 0, and
+ * is allocated using allocate_shared_raster() if SHARED is set.
+ * The raster and the file data are added to the hashers RASTER and ENCODED,
+ * unless they are NULL. Returns NULL on failure, with qoi_error set to
+ * indicate why.
+ */
+static Qoi *parse(
+		const unsigned char *input,
+		const size_t size,
+		const QoiChannel output_channels,
+		const char shared,
+		hasher *raster,
+		hasher *encoded)
+{
+	/* Ensure the file is a QOI file. */
+	if (size < QOI_HEADER_SIZE ||
+	    input[0] != 'q' ||
+	    input[1] != 'o' ||
+	    input[2] != 'i' ||
+	    input[3] != 'f') {
+
+		qoi_error = QOI_ERROR_NOT_QOI_FILE;
+		return NULL;
+	}
+
+	/* Get the header attributes, and allocate space for pixel data. */
+	uint32_t width = big_endian(input + 4);
+	uint32_t height = big_endian(input + 8);
+	QoiChannel channels = input[12];
+	QoiColorspace colorspace = input[13];
+
+	if (channels != QOI_CHANNEL_RGB && channels != QOI_CHANNEL_RGBA) {
+		qoi_error = QOI_ERROR_NOT_QOI_FILE;
+		return NULL;
+	}
+
+	/* The operations do not depend on the channel count, so alpha can be
+	 * dropped or added while decoding. */
+	if (output_channels != 0) {
+		channels = output_channels;
+	}
+
+	void (*freer)(void*) = shared ? free_shared : free;
+	uint8_t *pixel_data = shared ?
+		allocate_shared_raster(width, height, colorspace, channels) :
+		allocate_raster(width, height, channels);
+
+	if (pixel_data == NULL) {
+		qoi_error = QOI_ERROR_MEMORY;
+		return NULL;
+	}
+
+	/* Decode the file body into pixel data one block at a time, so that each
+	 * block is hashed while it is still in the cache. */
+	codec_state state;
+	codec_state_init(&state);
+	size_t pixels = (size_t) width * height;
+	size_t input_index = QOI_HEADER_SIZE;
+
+	if (encoded != NULL) {
+		hasher_update(encoded, input, QOI_HEADER_SIZE);
+	}
+
+	tracer trace;
+	tracer_init(&trace);
+	QOI_PROBE(decode_start, size, pixels);
+	uint64_t start = tracer_clock(&trace);
+
+	for (size_t i = 0; i < pixels; i += QOI_BLOCK_PIXELS) {
+		size_t block_pixels = MIN(pixels - i, QOI_BLOCK_PIXELS);
+		uint8_t *output = pixel_data + i * channels;
+		ssize_t used = decode(&state,
+		                      input + input_index,
+		                      size - input_index,
+		                      output,
+		                      block_pixels,
+		                      channels);
+
+		if (used == -1) {
+			qoi_error = QOI_ERROR_FILE_CONTENT;
+			freer(pixel_data);
+			return NULL;
+		}
+
+		if (raster != NULL) {
+			hasher_update(raster, output, block_pixels * channels);
+		}
+		if (encoded != NULL) {
+			hasher_update(encoded, input + input_index, used);
+		}
+		input_index += used;
+	}
+
+	QOI_PROBE(decode_done, input_index, pixels);
+	tracer_report(&trace, QOI_PHASE_DECODE, tracer_clock(&trace) - start, input_index, pixels);
+
+	/* The hash of the file data includes the trailer. */
+	if (encoded != NULL) {
+		hasher_update(encoded, input + input_index, size - input_index);
+	}
+
+	/* Create a QOI object from the pixel data. */
+
+	return qoi_new_from_data(
+			width,
+			height,
+			colorspace,
+			channels,
+			pixel_data,
+			freer);
+}
+
+/**
+ * Writes the header fields of SELF, preceded by the four byte MAGIC, into
+ * the first 14 bytes of OUTPUT.
+ */
+static void make_header(
+		const Qoi *self,
+		const char *magic,
+		char *output)
+{
+	memcpy(output, magic, 4);
+	big_endian_r(output + 4, self->width);
+	big_endian_r(output + 8, self->height);
+	output[12] = self->channels;
+	output[13] = self->colorspace;
+}
+
+/**
+ * Resets STATE to the state at the start of a QOI stream.
+ */
+static void codec_state_init(
+		codec_state *state)
+{
+	state->last_color = (color) { .r = 0, .g = 0, .b = 0, .a = 255 };
+	memset(state->previous_colors, 0, sizeof(state->previous_colors));
+	state->run = 0;
+}
+
+/**
+ * Decodes PIXEL_COUNT pixels from the INPUT_SIZE bytes of QOI operations in
+ * INPUT into the pixel buffer OUTPUT, continuing on from STATE. Returns the
+ * number of bytes of INPUT used, or -1 if INPUT ends too early. A run may
+ * carry on past the last pixel, in which case the rest of it is written by
+ * the next call.
+ */
+static ssize_t decode(
+		codec_state *state,
+		const unsigned char *input,
+		const size_t input_size,
+		uint8_t *output,
+		const size_t pixel_count,
+		const QoiChannel channels)
+{
+	/* Each call has a constant channel count, so the checks of it for each
+	 * pixel are resolved at compile time. */
+	if (channels == QOI_CHANNEL_RGBA) {
+		return decode_channels(state, input, input_size, output, pixel_count, 4);
+	}
+
+	return decode_channels(state, input, input_size, output, pixel_count, 3);
+}
+
+/**
+ * The body of decode(), inlined once for each channel count.
+ */
+static QOI_ALWAYS_INLINE ssize_t decode_channels(
+		codec_state *state,
+		const unsigned char *input,
+		const size_t input_size,
+		uint8_t *output,
+		const size_t pixel_count,
+		const QoiChannel channels)
+{
+	size_t input_index = 0;
+	color last_color = state->last_color;
+
+	for (size_t i = 0; i < pixel_count; i++) {
+		if (state->run > 0) {
+			/* Continue a run of the previous color. */
+			state->run--;
+		} else {
+			if (input_index >= input_size) {
+				return -1;
+			}
+
+			uint8_t byte = input[input_index++];
+
+			if (IS_QOI_OP_RGB(byte)) {
+				if (input_size - input_index < 3) {
+					return -1;
+				}
+
+				last_color.r = input[input_index++];
+				last_color.g = input[input_index++];
+				last_color.b = input[input_index++];
+			} else if (IS_QOI_OP_RGBA(byte)) {
+				if (input_size - input_index < 4) {
+					return -1;
+				}
+
+				last_color.r = input[input_index++];
+				last_color.g = input[input_index++];
+				last_color.b = input[input_index++];
+				last_color.a = input[input_index++];
+			} else if (IS_QOI_OP_INDEX(byte)) {
+				last_color = state->previous_colors[byte & 0x3F];
+			} else if (IS_QOI_OP_DIFF(byte)) {
+				uint8_t dr = (byte & 0x30) >> 4;
+				uint8_t dg = (byte & 0x0C) >> 2;
+				uint8_t db = byte & 0x03;
+
+				last_color.r += dr - 2;
+				last_color.g += dg - 2;
+				last_color.b += db - 2;
+			} else if (IS_QOI_OP_LUMA(byte)) {
+				if (input_index >= input_size) {
+					return -1;
+				}
+
+				int8_t dg = (byte & 0x3F) - 32;
+				int8_t drdg = (input[input_index] & 0xF0) >> 4;
+				int8_t dbdg = input[input_index] & 0x0F;
+				input_index++;
+
+				last_color.r += dg + (drdg - 8);
+				last_color.g += dg;
+				last_color.b += dg + (dbdg - 8);
+			} else {
+				/* The first pixel of the run is written below. */
+				state->run = byte & 0x3F;
+			}
+
+			state->previous_colors[color_hash(last_color)] = last_color;
+		}
+
+		output[0] = last_color.r;
+		output[1] = last_color.g;
+		output[2] = last_color.b;
+		if (channels == QOI_CHANNEL_RGBA) {
+			output[3] = last_color.a;
+		}
+		output += channels;
+	}
+
+	state->last_color = last_color;
+	return input_index;
+}
+
+/**
+ * Encodes PIXEL_COUNT pixels from INPUT into QOI operations in OUTPUT,
+ * continuing on from STATE. A run may carry on past the last pixel, up to the
+ * AVAILABLE pixels in INPUT, in which case the next call skips the rest of it.
+ * Runs are then found just as if the pixels were encoded in one call, as the
+ * decoder expects. OUTPUT must have room for CHANNELS + 1 bytes per pixel.
+ * Returns the number of bytes written to OUTPUT.
+ */
+static size_t encode(
+		codec_state *state,
+		const uint8_t *input,
+		const size_t pixel_count,
+		const size_t available,
+		const QoiChannel channels,
+		uint8_t *output)
+{
+	/* As in decode(), each call has a constant channel count. */
+	if (channels == QOI_CHANNEL_RGBA) {
+		return encode_channels(state, input, pixel_count, available, 4, output);
+	}
+
+	return encode_channels(state, input, pixel_count, available, 3, output);
+}
+
+/**
+ * The body of encode(), inlined once for each channel count.
+ */
+static QOI_ALWAYS_INLINE size_t encode_channels(
+		codec_state *state,
+		const uint8_t *input,
+		const size_t pixel_count,
+		const size_t available,
+		const QoiChannel channels,
+		uint8_t *output)
+{
+	size_t output_index = 0;
+	color last_color = state->last_color;
+
+	/* Without an OUTPUT, each operation is written over the last one, so
+	 * that only the bytes are counted. */
+	uint8_t scratch[5];
+
+	/* Skip the pixels covered by a run written by the previous call. */
+	size_t i = MIN((size_t) state->run, pixel_count);
+	state->run -= i;
+
+	for (; i < pixel_count; i++) {
+		uint8_t *op = output != NULL ? output + output_index : scratch;
+
+		/* Determine the color of the next pixel to process. */
+		color current_pixel = create_color(input + (i * channels), channels);
+
+		/* Determine the differences in colors, used to figure out which
+		 * operation to use to encode the data. */
+		int8_t dr = current_pixel.r - last_color.r;
+		int8_t dg = current_pixel.g - last_color.g;
+		int8_t db = current_pixel.b - last_color.b;
+		int8_t da = current_pixel.a - last_color.a;
+
+		int8_t drdg = dr - dg;
+		int8_t dbdg = db - dg;
+
+		int idx;
+
+		if (color_equal(last_color, current_pixel)) {
+			/* Case 1: Use a run of the previous color, of at most 62
+			 * pixels. */
+			size_t length = 1;
+			while (i + length < available &&
+			       length < 62 &&
+			       color_equal(last_color,
+			                   create_color(input + ((i + length) * channels),
+			                                channels))) {
+
+				++length;
+			}
+
+			/* Write a run-length operation. */
+			length--;
+			op[0] = 0xC0 | length;
+			output_index += 1;
+
+			i += length;
+		} else if (dr >= -2 && dr <= 1 &&
+		           dg >= -2 && dg <= 1 &&
+		           db >= -2 && db <= 1 &&
+		           da == 0) {
+
+			/* Case 2: Use a difference of each of red, green, and blue. */
+			op[0] = 0x40 | ((dr + 2) << 4) | ((dg + 2) << 2) | (db + 2);
+			output_index += 1;
+		} else if ((idx = index_of(state->previous_colors, 64, current_pixel)) != -1) {
+			/* Case 3: Use an index in the previous colors array. */
+			op[0] = idx;
+			output_index += 1;
+		} else if (dg >= -32 && dg <= 31 &&
+		           drdg >= -8 && drdg <= 7 &&
+		           dbdg >= -8 && dbdg <= 7 &&
+		           da == 0) {
+
+			/* Case 4: Use a change in luma. */
+			op[0] = 0x80 | (dg + 32);
+			op[1] = ((drdg + 8) << 4) | (dbdg + 8);
+			output_index += 2;
+		} else if (da == 0) {
+			/* Case 5: Completely redefine the red, green, and blue values. */
+			op[0] = 0xFE;
+			op[1] = current_pixel.r;
+			op[2] = current_pixel.g;
+			op[3] = current_pixel.b;
+			output_index += 4;
+		} else {
+			/* Case 6: Completely redefine r, g, b, and alpha values. */
+			op[0] = 0xFF;
+			op[1] = current_pixel.r;
+			op[2] = current_pixel.g;
+			op[3] = current_pixel.b;
+			op[4] = current_pixel.a;
+			output_index += 5;
+		}
+
+		last_color = current_pixel;
+		state->previous_colors[color_hash(current_pixel)] = current_pixel;
+	}
+
+	/* A run that carried on past the last pixel left I beyond it. */
+	state->run += i - pixel_count;
+	state->last_color = last_color;
+	return output_index;
+}
+
+/**
+ * Returns the number of bytes that encode() would write for PIXEL_COUNT pixels
+ * from INPUT, continuing on from STATE, without writing them. Runs end at the
+ * last pixel.
+ */
+static size_t measure(
+		codec_state *state,
+		const uint8_t *input,
+		const size_t pixel_count,
+		const QoiChannel channels)
+{
+	if (channels == QOI_CHANNEL_RGBA) {
+		return encode_channels(state, input, pixel_count, pixel_count, 4, NULL);
+	}
+
+	return encode_channels(state, input, pixel_count, pixel_count, 3, NULL);
+}
+
+/**
+ * Returns the share of the bytes of the file that qoi_save() would write for
+ * SELF that falls to the pixels from FIRST up to LAST. The bound on the error
+ * of the share, from history that is not followed far enough back, is added
+ * to UNCERTAINTY.
+ */
+static double measure_span(
+		const Qoi *self,
+		const size_t first,
+		const size_t last,
+		double *uncertainty)
+{
+	size_t pixels = (size_t) self->width * self->height;
+	const QoiChannel channels = self->channels;
+	const uint8_t *data = self->data;
+	codec_state state;
+	codec_state_init(&state);
+
+	/* Rebuild the encoder's state at FIRST: the pixel before it, and for
+	 * each entry in the 'previous colors' array, the last pixel before it
+	 * with that hash. Entries not found by the start of the image are still
+	 * as the encoder starts them. */
+	uint64_t known = 0;
+	size_t i = first;
+	size_t horizon = first > QOI_ESTIMATE_HISTORY_PIXELS ? first - QOI_ESTIMATE_HISTORY_PIXELS : 0;
+	for (; i > horizon && known != UINT64_MAX; i--) {
+		color pixel = create_color(data + (i - 1) * channels, channels);
+		int hash = color_hash(pixel);
+		if (!(known & (1ull << hash))) {
+			state.previous_colors[hash] = pixel;
+			known |= 1ull << hash;
+		}
+	}
+
+	if (i == 0) {
+		known = UINT64_MAX;
+	}
+	if (first > 0) {
+		state.last_color = create_color(data + (first - 1) * channels, channels);
+	}
+
+	/* A run's operations fall wherever the run happens to start, so runs
+	 * reaching into the span from before it, or out of it past its end, are
+	 * charged by the share of their pixels within it instead. */
+	color before = state.last_color;
+	size_t lead = first;
+	while (lead < last && color_equal(create_color(data + lead * channels, channels), before)) {
+		lead++;
+	}
+
+	size_t tail = last;
+	color end = create_color(data + (last - 1) * channels, channels);
+	if (lead < last &&
+	    last < pixels &&
+	    color_equal(create_color(data + last * channels, channels), end)) {
+
+		/* The run starts after the last pixel of another color, which is
+		 * measured with the rest of the span. */
+		while (tail - 1 > lead &&
+		       color_equal(create_color(data + (tail - 2) * channels, channels), end)) {
+
+			tail--;
+		}
+	}
+
+	double size = 0;
+	if (lead > first) {
+		size += run_share(self, first, lead - first, before, uncertainty);
+	}
+	if (tail < last) {
+		size += run_share(self, tail, last - tail, end, uncertainty);
+	}
+
+	size += measure(&state, data + lead * channels, tail - lead, channels);
+
+	/* An entry of the array not found within the history is only looked up
+	 * by the first pixel in the span with its hash, which writes it. Getting
+	 * that one lookup wrong costs at most 4 bytes, saved by QOI_OP_INDEX. */
+	uint64_t unknown = 0;
+	for (size_t j = lead; j < tail && unknown != ~known; j++) {
+		unknown |= (1ull << color_hash(create_color(data + j * channels, channels))) & ~known;
+	}
+	*uncertainty += 4 * __builtin_popcountll(unknown);
+
+	return size;
+}
+
+/**
+ * Returns the share of the bytes of a run of the color RUN_COLOR that falls
+ * to the COUNT pixels of SELF from START, all of which are in the run. The
+ * bound on the error of the share is added to UNCERTAINTY.
+ */
+static double run_share(
+		const Qoi *self,
+		const size_t start,
+		const size_t count,
+		const color run_color,
+		double *uncertainty)
+{
+	size_t pixels = (size_t) self->width * self->height;
+	const QoiChannel channels = self->channels;
+	const uint8_t *data = self->data;
+
+	/* Follow the run both ways. The pixel that it repeats is not part of
+	 * it, unless the run repeats the color that the encoder starts with. */
+	size_t before = 0, after = 0;
+	while (start - before > 0 &&
+	       before < QOI_ESTIMATE_HISTORY_PIXELS &&
+	       color_equal(create_color(data + (start - before - 1) * channels, channels), run_color)) {
+
+		before++;
+	}
+
+	codec_state initial;
+	codec_state_init(&initial);
+	char whole = before < QOI_ESTIMATE_HISTORY_PIXELS;
+	if (whole && (start - before > 0 || !color_equal(run_color, initial.last_color))) {
+		before--;
+	}
+
+	size_t end = start + count;
+	while (end + after < pixels &&
+	       after < QOI_ESTIMATE_HISTORY_PIXELS &&
+	       color_equal(create_color(data + (end + after) * channels, channels), run_color)) {
+
+		after++;
+	}
+	whole = whole && after < QOI_ESTIMATE_HISTORY_PIXELS;
+
+	/* The encoder spends a byte on each 62 pixels of the run. The cost of a
+	 * run followed as far as the history goes is taken as the cost of an
+	 * endless one, which differs by less than a byte over the whole run. */
+	size_t length = before + count + after;
+	if (!whole) {
+		*uncertainty += (double) count / length;
+		return (double) count / 62;
+	}
+
+	return (double) count * ((length + 61) / 62) / length;
+}
+
+/**
+ * Returns the share of the bytes of the file that falls to the
+ * QOI_ESTIMATE_SAMPLE_PIXELS pixels of SELF from START, adding the bound on
+ * its error to UNCERTAINTY. A sample that runs off the end of the raster
+ * continues from its start.
+ */
+static double measure_sample(
+		const Qoi *self,
+		const size_t start,
+		double *uncertainty)
+{
+	size_t pixels = (size_t) self->width * self->height;
+	size_t length = MIN(QOI_ESTIMATE_SAMPLE_PIXELS, pixels - start);
+	double size = measure_span(self, start, start + length, uncertainty);
+
+	if (length < QOI_ESTIMATE_SAMPLE_PIXELS) {
+		size += measure_span(self, 0, QOI_ESTIMATE_SAMPLE_PIXELS - length, uncertainty);
+	}
+
+	return size;
+}
+
+/**
+ * Returns the square root of VALUE, or 0 if VALUE is not positive.
+ */
+static double square_root(
+		const double value)
+{
+	if (!(value > 0)) {
+		return 0;
+	}
+
+	/* Newton's method, which halves any large starting error each step
+	 * before converging quickly. */
+	double root = value > 1 ? value : 1;
+	for (int i = 0; i < 128; i++) {
+		double next = (root + value / root) / 2;
+		if (next >= root) {
+			break;
+		}
+		root = next;
+	}
+
+	return root;
+}
+
+/**
+ * Returns the properties shared by all of the PIXEL_COUNT pixels in INPUT.
+ */
+static QoiProperties scan(
+		const uint8_t *input,
+		const size_t pixel_count,
+		const QoiChannel channels)
+{
+	if (channels == QOI_CHANNEL_RGBA) {
+		return scan_channels(input, pixel_count, 4);
+	}
+
+	return scan_channels(input, pixel_count, 3);
+}
+
+/**
+ * The body of scan(), inlined once for each channel count. Each test is
+ * folded into a single byte without branching, so that the loop over each
+ * group of pixels can be vectorized.
+ */
+static QOI_ALWAYS_INLINE QoiProperties scan_channels(
+		const uint8_t *input,
+		const size_t pixel_count,
+		const QoiChannel channels)
+{
+	uint8_t alpha = 255, partial = 0, chroma = 0;
+	size_t i = 0;
+
+	for (; i + QOI_SCAN_PIXELS < pixel_count; i += QOI_SCAN_PIXELS) {
+		const uint8_t *group = input + (i * channels);
+
+		if (channels == QOI_CHANNEL_RGBA) {
+			for (size_t j = 0; j < QOI_SCAN_PIXELS; j++) {
+				const uint8_t *pixel = group + (j * 4);
+				chroma |= (pixel[0] ^ pixel[1]) | (pixel[1] ^ pixel[2]);
+				alpha &= pixel[3];
+				partial |= (uint8_t) (pixel[3] + 1) & 0xFE;
+			}
+			continue;
+		}
+
+		/* GCC cannot vectorize loads with a stride of 3, so RGB pixels are
+		 * tested as a run of bytes. This reads the first byte of the pixel
+		 * after the group, so the last pixels are left to the loop below. */
+		for (size_t k = 0; k < QOI_SCAN_PIXELS * 3; k++) {
+			chroma |= (group[k] ^ group[k + 1]) & scan_rgb_mask[k];
+		}
+	}
+
+	/* Test the pixels left over from the groups. */
+	for (; i < pixel_count; i++) {
+		const uint8_t *pixel = input + (i * channels);
+		chroma |= (pixel[0] ^ pixel[1]) | (pixel[1] ^ pixel[2]);
+
+		if (channels == QOI_CHANNEL_RGBA) {
+			/* Adding one takes 255 to 0 and 0 to 1, and every other
+			 * alpha value to 2 or more. */
+			alpha &= pixel[3];
+			partial |= (uint8_t) (pixel[3] + 1) & 0xFE;
+		}
+	}
+
+	return (alpha == 255 ? QOI_PROPERTY_OPAQUE : 0) |
+	       (partial == 0 ? QOI_PROPERTY_BINARY_ALPHA : 0) |
+	       (chroma == 0 ? QOI_PROPERTY_GRAYSCALE : 0);
+}
+
+/**
+ * Encodes the pixel data in SELF and writes it into the FILE, one block of
+ * pixels at a time. If COMPRESSED is set, each block is compressed and written
+ * after a header giving its pixel count and sizes, and may refer back into
+ * the blocks before it. Encoding is reported to the trace callback, and the
+ * time taken writing is added to WRITE_TIME, for the caller to report once it
+ * has closed the FILE. If WRITE_TIME is NULL, the FILE is a memory stream, and
+ * writing to it is traced as encoding instead. Each block of
+ * pixels and of file data is added to the hashers RASTER and ENCODED, unless
+ * they are NULL, and the properties of each block of pixels are combined into
+ * PROPERTIES, unless it is NULL. The FILE should already be open, and will not
+ * be closed by this function.
+ * Returns 0 on success and a qoi_error code on failure. This does not write
+ * the header nor the trailer.
+ */
+static int encode_to_file(
+		const Qoi *self,
+		FILE *file,
+		const char compressed,
+		uint64_t *write_time,
+		hasher *raster,
+		hasher *encoded,
+		QoiProperties *properties)
+{
+	size_t pixels = (size_t) self->width * self->height;
+	size_t raw_max = QOI_BLOCK_PIXELS * (self->channels + 1);
+
+	/* Compressed blocks keep the operations before them in the window. */
+	uint8_t *window = malloc((compressed ? QOI_LZ_WINDOW : 0) + raw_max);
+	uint8_t *stored = compressed ? malloc(QOI_LZ_BOUND(raw_max)) : NULL;
+	uint32_t *table = compressed ? calloc(QOI_LZ_TABLE_SIZE, sizeof(uint32_t)) : NULL;
+	if (window == NULL || (compressed && (stored == NULL || table == NULL))) {
+		free(window);
+		free(stored);
+		free(table);
+		return QOI_ERROR_MEMORY;
+	}
+
+	codec_state state;
+	codec_state_init(&state);
+	size_t history = 0;
+	int error = QOI_ERROR_NONE;
+
+	/* Encoding and writing alternate, so the time of each is added up. */
+	tracer trace;
+	tracer_init(&trace);
+	uint64_t encode_time = 0;
+	size_t encoded_size = 0;
+
+	/* Copying the encoded blocks into memory is part of encoding, so only
+	 * writes to a real file are probed and timed as writing. */
+	char in_memory = write_time == NULL;
+	uint64_t *copy_time = in_memory ? &encode_time : write_time;
+
+	if (properties != NULL) {
+		*properties = QOI_PROPERTY_OPAQUE | QOI_PROPERTY_BINARY_ALPHA | QOI_PROPERTY_GRAYSCALE;
+	}
+
+	for (size_t i = 0; i < pixels && error == QOI_ERROR_NONE; i += QOI_BLOCK_PIXELS) {
+		size_t block_pixels = MIN(pixels - i, QOI_BLOCK_PIXELS);
+		const uint8_t *input = self->data + i * self->channels;
+		uint8_t *raw = window + history;
+
+		QOI_PROBE(encode_start, block_pixels);
+		uint64_t start = tracer_clock(&trace);
+		size_t size = encode(&state, input, block_pixels, pixels - i, self->channels, raw);
+		encode_time += tracer_clock(&trace) - start;
+		encoded_size += size;
+		QOI_PROBE(encode_done, size, block_pixels);
+
+		if (raster != NULL) {
+			hasher_update(raster, input, block_pixels * self->channels);
+		}
+		if (properties != NULL) {
+			*properties &= scan(input, block_pixels, self->channels);
+		}
+
+		if (!compressed) {
+			if (!in_memory) {
+				QOI_PROBE(write_start, size);
+			}
+			start = tracer_clock(&trace);
+			if (fwrite(raw, 1, size, file) < size) {
+				error = QOI_ERROR_DISK_SPACE;
+			}
+			*copy_time += tracer_clock(&trace) - start;
+			if (!in_memory) {
+				QOI_PROBE(write_done, size);
+			}
+
+			if (encoded != NULL) {
+				hasher_update(encoded, raw, size);
+			}
+			continue;
+		}
+
+		/* Store the block as it is if it does not compress. Compressing is
+		 * timed as part of encoding. */
+		start = tracer_clock(&trace);
+		const uint8_t *block = stored;
+		size_t stored_size = lz_compress(window, history, history + size, table, stored);
+		if (stored_size >= size) {
+			block = raw;
+			stored_size = size;
+		}
+		encode_time += tracer_clock(&trace) - start;
+
+		char header[QOI_LZ_BLOCK_HEADER_SIZE];
+		big_endian_r(header, block_pixels);
+		big_endian_r(header + 4, size);
+		big_endian_r(header + 8, stored_size);
+
+		if (!in_memory) {
+			QOI_PROBE(write_start, QOI_LZ_BLOCK_HEADER_SIZE + stored_size);
+		}
+		start = tracer_clock(&trace);
+		if (fwrite(header, 1, QOI_LZ_BLOCK_HEADER_SIZE, file) < QOI_LZ_BLOCK_HEADER_SIZE ||
+		    fwrite(block, 1, stored_size, file) < stored_size) {
+
+			error = QOI_ERROR_DISK_SPACE;
+		}
+		*copy_time += tracer_clock(&trace) - start;
+		if (!in_memory) {
+			QOI_PROBE(write_done, QOI_LZ_BLOCK_HEADER_SIZE + stored_size);
+		}
+
+		if (encoded != NULL) {
+			hasher_update(encoded, (uint8_t*) header, QOI_LZ_BLOCK_HEADER_SIZE);
+			hasher_update(encoded, block, stored_size);
+		}
+
+		history = slide_window(window, history + size, table);
+	}
+
+	if (error == QOI_ERROR_NONE) {
+		tracer_report(&trace, QOI_PHASE_ENCODE, encode_time, encoded_size, pixels);
+	}
+
+	free(window);
+	free(stored);
+	free(table);
+	return error;
+}
+
+/**
+ * Returns the index in the ARRAY that contains the given VALUE.
+ */
+static int index_of(
+		const color *array,
+		const size_t arraylen,
+		const color value)
+{
+	for (int i = 0; i < arraylen; i++) {
+		if (color_equal(array[i], value)) {
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+/**
+ * Returns the number of channels present in the image. This is either 3 or 4,
+ * depending on if the image has an alpha channel or not.
+ */
+int qoi_get_channels(
+		const Qoi *self)
+{
+	return self->channels;
+}
+
+/**
+ * Allocates an operation and queues its first STEP on POOL. Returns NULL on
+ * failure, with qoi_error set to indicate why.
+ */
+static QoiAsync *async_start(
+		const char *filepath,
+		const Qoi *source,
+		async_pool *pool,
+		void (*step)(QoiAsync*),
+		void (*callback)(QoiAsync*, void*),
+		void *userdata)
+{
+	pthread_once(&async_pools_started, async_start_pools);
+
+	QoiAsync *op = malloc(sizeof(QoiAsync));
+	if (op == NULL) {
+		qoi_error = QOI_ERROR_MEMORY;
+		return NULL;
+	}
+
+	op->finished = 0;
+	op->source = source;
+	op->buffer = NULL;
+	op->size = 0;
+	op->result = NULL;
+	op->error = QOI_ERROR_NONE;
+	op->callback = callback;
+	op->userdata = userdata;
+
+	op->filepath = strdup(filepath);
+	if (op->filepath == NULL) {
+		qoi_error = QOI_ERROR_MEMORY;
+		free(op);
+		return NULL;
+	}
+
+	op->fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (op->fd == -1) {
+		qoi_error = QOI_ERROR_MEMORY;
+		free(op->filepath);
+		free(op);
+		return NULL;
+	}
+
+	pthread_mutex_init(&op->lock, NULL);
+	pthread_cond_init(&op->done, NULL);
+
+	async_queue(pool, op, step);
+	return op;
+}
+
+/**
+ * Starts the worker threads of the I/O and codec pools. Called once, by the
+ * first background operation. The workers are detached, and wait on their
+ * queues for as long as the process lasts. If fewer threads can be started,
+ * the pools run with fewer.
+ */
+static void async_start_pools(void)
+{
+	long processors = sysconf(_SC_NPROCESSORS_ONLN);
+	size_t codec_threads = processors > 1 ? (size_t) processors : 1;
+
+	pthread_attr_t attributes;
+	if (pthread_attr_init(&attributes) != 0) {
+		return;
+	}
+	pthread_attr_setdetachstate(&attributes, PTHREAD_CREATE_DETACHED);
+
+	pthread_t id;
+	while (io_pool.threads < QOI_ASYNC_IO_THREADS &&
+	       pthread_create(&id, &attributes, async_worker, &io_pool) == 0) {
+
+		io_pool.threads++;
+	}
+	while (codec_pool.threads < codec_threads &&
+	       pthread_create(&id, &attributes, async_worker, &codec_pool) == 0) {
+
+		codec_pool.threads++;
+	}
+
+	pthread_attr_destroy(&attributes);
+}
+
+/**
+ * Queues the operation OP on POOL, to have STEP run on it by one of the
+ * pool's workers. If the pool has no workers, STEP is run straight away.
+ */
+static void async_queue(
+		async_pool *pool,
+		QoiAsync *op,
+		void (*step)(QoiAsync*))
+{
+	op->step = step;
+	op->next = NULL;
+
+	if (pool->threads == 0) {
+		step(op);
+		return;
+	}
+
+	pthread_mutex_lock(&pool->lock);
+	if (pool->tail != NULL) {
+		pool->tail->next = op;
+	} else {
+		pool->head = op;
+	}
+	pool->tail = op;
+	pthread_cond_signal(&pool->ready);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+/**
+ * The thread routine of a worker, which runs the steps queued on the
+ * async_pool POOL for as long as the process lasts.
+ */
+static void *async_worker(
+		void *pool)
+{
+	async_pool *self = pool;
+
+	while (1) {
+		pthread_mutex_lock(&self->lock);
+		while (self->head == NULL) {
+			pthread_cond_wait(&self->ready, &self->lock);
+		}
+
+		QoiAsync *op = self->head;
+		self->head = op->next;
+		if (self->head == NULL) {
+			self->tail = NULL;
+		}
+		pthread_mutex_unlock(&self->lock);
+
+		op->step(op);
+	}
+
+	return NULL;
+}
+
+/**
+ * The I/O step of qoi_new_from_file_async(), which reads the file and then
+ * hands it to the codec pool.
+ */
+static void async_read(
+		QoiAsync *op)
+{
+	op->buffer = read_file(op->filepath, &op->size);
+	if (op->buffer == NULL) {
+		op->error = qoi_error;
+		async_finish(op);
+		return;
+	}
+
+	async_queue(&codec_pool, op, async_decode);
+}
+
+/**
+ * The codec step of qoi_new_from_file_async(), which decodes the file read by
+ * async_read().
+ */
+static void async_decode(
+		QoiAsync *op)
+{
+	op->result = parse(op->buffer, op->size, 0, 0, NULL, NULL);
+	if (op->result == NULL) {
+		op->error = qoi_error;
+	}
+
+	free(op->buffer);
+	op->buffer = NULL;
+	async_finish(op);
+}
+
+/**
+ * The codec step of qoi_save_async(), which encodes the image into memory and
+ * then hands it to the I/O pool.
+ */
+static void async_encode(
+		QoiAsync *op)
+{
+	char *data = NULL;
+	FILE *stream = open_memstream(&data, &op->size);
+	if (stream == NULL) {
+		op->error = QOI_ERROR_MEMORY;
+		async_finish(op);
+		return;
+	}
+
+	/* Writing to memory can only fail for want of memory. */
+	int error = write_file(op->source, stream, 0, NULL, NULL, NULL, NULL);
+	if (fclose(stream) != 0 || error != QOI_ERROR_NONE) {
+		op->error = QOI_ERROR_MEMORY;
+		free(data);
+		async_finish(op);
+		return;
+	}
+
+	op->buffer = (unsigned char*) data;
+	async_queue(&io_pool, op, async_write);
+}
+
+/**
+ * The I/O step of qoi_save_async(), which writes the file encoded by
+ * async_encode().
+ */
+static void async_write(
+		QoiAsync *op)
+{
+	tracer trace;
+	tracer_init(&trace);
+
+	QOI_PROBE(write_start, op->size);
+	uint64_t start = tracer_clock(&trace);
+	int fd = open(op->filepath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+	if (fd == -1) {
+		op->error = QOI_ERROR_PERMISSIONS;
+	}
+
+	size_t written = 0;
+	while (fd != -1 && written < op->size) {
+		ssize_t result = write(fd, op->buffer + written, op->size - written);
+		if (result == -1 && errno == EINTR) {
+			continue;
+		}
+		if (result <= 0) {
+			op->error = QOI_ERROR_DISK_SPACE;
+			break;
+		}
+		written += result;
+	}
+
+	if (fd != -1 && close(fd) != 0 && op->error == QOI_ERROR_NONE) {
+		op->error = QOI_ERROR_DISK_SPACE;
+	}
+
+	if (op->error == QOI_ERROR_NONE) {
+		QOI_PROBE(write_done, op->size);
+		tracer_report(&trace, QOI_PHASE_WRITE, tracer_clock(&trace) - start, op->size, 0);
+	}
+
+	free(op->buffer);
+	op->buffer = NULL;
+	async_finish(op);
+}
+
+/**
+ * Signals the completion of the operation OP and runs its callback. OP may be
+ * freed as soon as FINISHED is set, so it is not touched after that.
+ */
+static void async_finish(
+		QoiAsync *op)
+{
+	uint64_t one = 1;
+	write(op->fd, &one, sizeof(one));
+
+	if (op->callback != NULL) {
+		op->callback(op, op->userdata);
+	}
+
+	pthread_mutex_lock(&op->lock);
+	op->finished = 1;
+	pthread_cond_broadcast(&op->done);
+	pthread_mutex_unlock(&op->lock);
+}
+
+/**
+ * Returns the number of strips in a chunked image with the given HEIGHT and
+ * STRIP_HEIGHT.
+ */
+static size_t strip_count(
+		const uint32_t height,
+		const uint32_t strip_height)
+{
+	if (strip_height == 0) {
+		return 0;
+	}
+
+	return ((size_t) height + strip_height - 1) / strip_height;
+}
+
+/**
+ * Encodes the strip at INDEX of the chunked_job JOB into a new buffer.
+ */
+static void encode_strip(
+		void *job,
+		size_t index)
+{
+	chunked_job *self = job;
+	const Qoi *image = self->image;
+
+	size_t first_row = index * self->strip_height;
+	size_t rows = MIN(self->strip_height, image->height - first_row);
+	size_t pixels = rows * image->width;
+
+	unsigned char *strip = malloc(pixels * (image->channels + 1) + 1);
+	if (strip == NULL) {
+		self->error = QOI_ERROR_MEMORY;
+		return;
+	}
+
+	codec_state state;
+	codec_state_init(&state);
+	size_t size = encode(&state,
+	                     image->data + first_row * image->width * image->channels,
+	                     pixels,
+	                     pixels,
+	                     image->channels,
+	                     strip);
+
+	/* Give back the space reserved for the worst case. */
+	unsigned char *shrunk = realloc(strip, size + 1);
+	self->strips[index] = shrunk != NULL ? shrunk : strip;
+	self->sizes[index] = size;
+}
+
+/**
+ * Decodes the strip at INDEX of the chunked_job JOB into the image raster.
+ */
+static void decode_strip(
+		void *job,
+		size_t index)
+{
+	chunked_job *self = job;
+	const Qoi *image = self->image;
+
+	size_t first_row = index * self->strip_height;
+	size_t rows = MIN(self->strip_height, image->height - first_row);
+	uint64_t start = big_endian64(self->offsets + index * 8);
+	uint64_t end = big_endian64(self->offsets + (index + 1) * 8);
+
+	codec_state state;
+	codec_state_init(&state);
+	if (decode(&state,
+	           self->input + start,
+	           end - start,
+	           image->data + first_row * image->width * image->channels,
+	           rows * image->width,
+	           image->channels) == -1) {
+
+		self->error = QOI_ERROR_FILE_CONTENT;
+	}
+}
+
+/**
+ * Runs TASK on each index below COUNT, spreading the calls between as many
+ * threads as there are processors. CONTEXT is passed to each call. If fewer
+ * threads can be started, the remaining ones do more of the work.
+ */
+static void run_parallel(
+		void (*task)(void*, size_t),
+		void *context,
+		const size_t count)
+{
+	parallel_job job = {
+		.task = task,
+		.context = context,
+		.count = count,
+		.next = 0
+	};
+
+	long processors = sysconf(_SC_NPROCESSORS_ONLN);
+	size_t threads = MIN(processors > 1 ? (size_t) processors : 1, count);
+
+	/* The calling thread is one of the workers. */
+	pthread_t *ids = threads > 1 ? malloc((threads - 1) * sizeof(pthread_t)) : NULL;
+	size_t started = 0;
+	while (ids != NULL && started < threads - 1 &&
+	       pthread_create(&ids[started], NULL, parallel_worker, &job) == 0) {
+
+		started++;
+	}
+
+	parallel_worker(&job);
+
+	for (size_t i = 0; i < started; i++) {
+		pthread_join(ids[i], NULL);
+	}
+	free(ids);
+}
+
+/**
+ * The thread routine for run_parallel().
+ */
+static void *parallel_worker(
+		void *job)
+{
+	parallel_job *self = job;
+
+	size_t index;
+	while ((index = atomic_fetch_add(&self->next, 1)) < self->count) {
+		self->task(self->context, index);
+	}
+
+	return NULL;
+}
+
+/**
+ * Saves SELF to the file given by FILEPATH, as a .qoi file or, if COMPRESSED
+ * is set, as a compressed QOI file. The raster and the file data are added to
+ * the hashers RASTER and ENCODED, unless they are NULL. If PROPERTIES is not
+ * NULL, the properties of the image are stored in it, and an opaque image is
+ * saved with 3 channels. On success returns 0, otherwise returns -1, with
+ * qoi_error set to indicate why.
+ */
+static int save_file(
+		const Qoi *self,
+		const char *filepath,
+		const char compressed,
+		hasher *raster,
+		hasher *encoded,
+		QoiProperties *properties)
+{
+	/* Attempt to open the file. */
+	FILE *file = fopen(filepath, "wb");
+	if (file == NULL) {
+		qoi_error = QOI_ERROR_PERMISSIONS;
+		return -1;
+	}
+
+	uint64_t write_time = 0;
+	qoi_error = write_file(self, file, compressed, &write_time, raster, encoded, properties);
+	long written = ftell(file);
+
+	/* An opaque image is encoded just as it would be without its alpha
+	 * channel, so only the channel count in the header needs changing. */
+	if (qoi_error == QOI_ERROR_NONE &&
+	    properties != NULL &&
+	    self->channels == QOI_CHANNEL_RGBA &&
+	    (*properties & QOI_PROPERTY_OPAQUE) &&
+	    (fseek(file, 12, SEEK_SET) != 0 || fputc(QOI_CHANNEL_RGB, file) == EOF)) {
+
+		qoi_error = QOI_ERROR_DISK_SPACE;
+	}
+
+	/* Closing the file flushes the end of it, so it is timed as writing. */
+	tracer trace;
+	tracer_init(&trace);
+	uint64_t start = tracer_clock(&trace);
+	if (fclose(file) != 0 && qoi_error == QOI_ERROR_NONE) {
+		qoi_error = QOI_ERROR_DISK_SPACE;
+	}
+
+	if (qoi_error != QOI_ERROR_NONE) {
+		return -1;
+	}
+
+	write_time += tracer_clock(&trace) - start;
+	tracer_report(&trace, QOI_PHASE_WRITE, write_time, written, 0);
+	return 0;
+}
+
+/**
+ * Writes SELF into FILE as a .qoi file or, if COMPRESSED is set, as a
+ * compressed QOI file. The time taken writing is added to WRITE_TIME, or if it
+ * is NULL, the FILE is a memory stream and writing to it is traced as
+ * encoding. The raster and the file data are added
+ * to the hashers RASTER and ENCODED, unless they are NULL, and the properties
+ * of the image are stored in PROPERTIES, unless it is NULL. The FILE should
+ * already be open, and will not be closed by this function. Returns 0 on
+ * success and a qoi_error code on failure.
+ */
+static int write_file(
+		const Qoi *self,
+		FILE *file,
+		const char compressed,
+		uint64_t *write_time,
+		hasher *raster,
+		hasher *encoded,
+		QoiProperties *properties)
+{
+	/* Write header. */
+	char header[QOI_HEADER_SIZE];
+	make_header(self, compressed ? "qoiz" : "qoif", header);
+	if (fwrite(header, 1, QOI_HEADER_SIZE, file) < QOI_HEADER_SIZE) {
+		return QOI_ERROR_DISK_SPACE;
+	}
+
+	if (encoded != NULL) {
+		hasher_update(encoded, (uint8_t*) header, QOI_HEADER_SIZE);
+	}
+
+	/* Write the pixel data. */
+	int error = encode_to_file(self, file, compressed, write_time, raster, encoded, properties);
+	if (error != QOI_ERROR_NONE) {
+		return error;
+	}
+
+	/* Write the trailer. */
+	char trailer[QOI_TRAILER_SIZE] = { 0, 0, 0, 0, 0, 0, 0, 1 };
+	if (fwrite(trailer, 1, QOI_TRAILER_SIZE, file) < QOI_TRAILER_SIZE) {
+		return QOI_ERROR_DISK_SPACE;
+	}
+
+	if (encoded != NULL) {
+		hasher_update(encoded, (uint8_t*) trailer, QOI_TRAILER_SIZE);
+	}
+
+	return QOI_ERROR_NONE;
+}
+
+/**
+ * Reads the compressed blocks of a compressed QOI file from FILE, and decodes
+ * them into the raster of SELF. The FILE should already be open and past the
+ * header, and will not be closed by this function. Returns 0 on success and a
+ * qoi_error code on failure.
+ */
+static int decode_from_file(
+		Qoi *self,
+		FILE *file)
+{
+	size_t pixels = (size_t) self->width * self->height;
+	size_t raw_max = QOI_BLOCK_PIXELS * (self->channels + 1);
+
+	uint8_t *window = malloc(QOI_LZ_WINDOW + raw_max);
+	uint8_t *stored = malloc(raw_max);
+	if (window == NULL || stored == NULL) {
+		free(window);
+		free(stored);
+		return QOI_ERROR_MEMORY;
+	}
+
+	codec_state state;
+	codec_state_init(&state);
+	size_t history = 0;
+	int error = QOI_ERROR_NONE;
+
+	/* Reading and decoding alternate, so the time of each is added up. */
+	tracer trace;
+	tracer_init(&trace);
+	uint64_t read_time = 0, decode_time = 0;
+	size_t read_size = 0, decoded_size = 0;
+
+	for (size_t i = 0; i < pixels && error == QOI_ERROR_NONE; ) {
+		/* Read and check the block header. */
+		uint64_t start = tracer_clock(&trace);
+		unsigned char header[QOI_LZ_BLOCK_HEADER_SIZE];
+		if (fread(header, 1, QOI_LZ_BLOCK_HEADER_SIZE, file) < QOI_LZ_BLOCK_HEADER_SIZE) {
+			error = QOI_ERROR_FILE_CONTENT;
+			break;
+		}
+
+		size_t block_pixels = big_endian(header);
+		size_t raw_size = big_endian(header + 4);
+		size_t stored_size = big_endian(header + 8);
 
-	/* Decode the file body into pixel data, and create a QOI object from it. */
-	decode(file_buffer + 14,
-	       pixel_data,
-		   width * height * channels,
-	       channels - 3);
+		if (block_pixels == 0 ||
+		    block_pixels > QOI_BLOCK_PIXELS ||
+		    block_pixels > pixels - i ||
+		    raw_size > block_pixels * (self->channels + 1) ||
+		    stored_size > raw_size) {
 
-	free(file_buffer);
+			error = QOI_ERROR_FILE_CONTENT;
+			break;
+		}
 
-	return qoi_new_from_data(
-			width,
-			height,
-			colorspace,
-			channels,
-			pixel_data,
-			free);
+		/* Read the block. A block that could not be compressed is stored as
+		 * it is, straight into the window. */
+		uint8_t *raw = window + history;
+		uint8_t *block = stored_size == raw_size ? raw : stored;
+		QOI_PROBE(read_start, stored_size);
+		if (fread(block, 1, stored_size, file) < stored_size) {
+			error = QOI_ERROR_FILE_CONTENT;
+			break;
+		}
+
+		QOI_PROBE(read_done, stored_size);
+		read_time += tracer_clock(&trace) - start;
+		read_size += QOI_LZ_BLOCK_HEADER_SIZE + stored_size;
+
+		/* Recover the QOI operations of the block, and decode them. */
+		QOI_PROBE(decode_start, raw_size, block_pixels);
+		start = tracer_clock(&trace);
+		if (block == stored &&
+		    lz_decompress(stored, stored_size, window, history, raw_size) != (ssize_t) raw_size) {
+
+			error = QOI_ERROR_FILE_CONTENT;
+			break;
+		}
+
+		if (decode(&state,
+		           raw,
+		           raw_size,
+		           self->data + i * self->channels,
+		           block_pixels,
+		           self->channels) != (ssize_t) raw_size) {
+
+			error = QOI_ERROR_FILE_CONTENT;
+			break;
+		}
+
+		decode_time += tracer_clock(&trace) - start;
+		decoded_size += raw_size;
+		QOI_PROBE(decode_done, raw_size, block_pixels);
+
+		i += block_pixels;
+		history = slide_window(window, history + raw_size, NULL);
+	}
+
+	if (error == QOI_ERROR_NONE) {
+		tracer_report(&trace, QOI_PHASE_READ, read_time, read_size, 0);
+		tracer_report(&trace, QOI_PHASE_DECODE, decode_time, decoded_size, pixels);
+	}
+
+	free(window);
+	free(stored);
+	return error;
 }
 
 /**
- * Releases the resources held by a QOI object. Any buffers held by external
- * resources after this call will be invalid.
+ * Returns the hash of the four bytes at INPUT, used for indexing into the
+ * match table of the compressor.
  */
-void qoi_free(
-		Qoi *self)
+static uint32_t lz_hash(
+		const uint8_t *input)
 {
-	if (self->freer != NULL) {
-		self->freer(self->data);
-	}
-
-	free(self);
+	uint32_t value;
+	memcpy(&value, input, 4);
+	return (value * 2654435761u) >> (32 - QOI_LZ_HASH_BITS);
 }
 
 /**
- * Saves a QOI object to a .qoi file. On success returns 0, otherwise returns
- * -1. qoi_errno() can be used to find out why a save operation failed.
+ * Stores the part of LENGTH that does not fit in a four bit token field into
+ * OUTPUT, as a series of bytes that are added together. Returns the number of
+ * bytes written.
  */
-int qoi_save(
-		const Qoi *self,
-		const char *filepath)
+static size_t lz_write_length(
+		uint8_t *output,
+		size_t length)
 {
-	/* This macro is used only by this function. */
-#define QOI_SAFWRITE(buf,size,file) \
-	if (fwrite(buf, 1, size, file) < size) { \
-		qoi_error = QOI_ERROR_DISK_SPACE; \
-		fclose(file); \
-		return -1; \
-	}
-
-	/* Attempt to open the file. */
-	FILE *file = fopen(filepath, "wb");
-	if (file == NULL) {
-		qoi_error = QOI_ERROR_PERMISSIONS;
-		return -1;
+	if (length < 15) {
+		return 0;
 	}
 
-	/* Create header fields in big endian format. */
-	char magic[4] = { 'q', 'o', 'i', 'f' };
-	char big_endian_width[4], big_endian_height[4];
-	big_endian_r(big_endian_width, self->width);
-	big_endian_r(big_endian_height, self->height);
-
-	/* Write header. */
-	QOI_SAFWRITE(magic, 4, file);
-	QOI_SAFWRITE(big_endian_width, 4, file);
-	QOI_SAFWRITE(big_endian_height, 4, file);
-	QOI_SAFWRITE(&self->channels, 1, file);
-	QOI_SAFWRITE(&self->colorspace, 1, file);
-
-	/* Write the pixel data. */
-	qoi_error = encode(self, file);
-	if (qoi_error != QOI_ERROR_NONE) {
-		fclose(file);
-		return -1;
+	size_t output_index = 0;
+	for (length -= 15; length >= 255; length -= 255) {
+		output[output_index++] = 255;
 	}
+	output[output_index++] = length;
 
-	/* Write the trailer. */
-	char trailer[8] = { 0, 0, 0, 0, 0, 0, 0, 1 };
-	fwrite(trailer, 1, 8, file);
-
-	fclose(file);
-	return 0;
-#undef SAFEWRITE
+	return output_index;
 }
 
 /**
- * Gets the image buffer. Each pixel is represented with either 24 or 32 bits,
- * depending on if the Qoi object is set to QOI_CHANNEL_RGB or QOI_CHANNEL_RGBA
- * respectively. Keep in mind that this is the actual image buffer, and changing
- * values in this will result in the image being changed. Do not free this
- * buffer.
+ * Adds the bytes written by lz_write_length() at INPUT onto LENGTH, advancing
+ * INPUT_INDEX past them. Returns 0 on success and -1 if INPUT ends too early.
  */
-uint8_t *qoi_get_raster(
-		const Qoi *self)
+static int lz_read_length(
+		const uint8_t *input,
+		const size_t input_size,
+		size_t *input_index,
+		size_t *length)
 {
-	return self->data;
+	uint8_t byte;
+	do {
+		if (*input_index >= input_size) {
+			return -1;
+		}
+
+		byte = input[(*input_index)++];
+		*length += byte;
+	} while (byte == 255);
+
+	return 0;
 }
 
 /**
- * Gets a copy of the image buffer. Each pixel is represented with either 32 or
- * 24 bits, depending on if the Qoi image has an alpha channel or not,
- * respectively. This buffer may be changed without changing the Qoi image
- * itself. The returned value should be freed using free() when no longer
- * needed.
+ * Writes a sequence of LITERAL_LENGTH bytes copied from LITERALS, followed by
+ * a match of MATCH_LENGTH bytes starting OFFSET bytes back, into OUTPUT. The
+ * match is left out if MATCH_LENGTH is 0. Returns the number of bytes written.
  */
-uint8_t *qoi_get_raster_clone(
-		const Qoi *self)
+static size_t lz_write_sequence(
+		uint8_t *output,
+		const uint8_t *literals,
+		const size_t literal_length,
+		const size_t offset,
+		const size_t match_length)
 {
-	size_t size = self->width * self->height * self->channels;
-	uint8_t *clone = malloc(size);
-	memcpy(clone, self->data, size);
-	return clone;
+	size_t extra_length = match_length == 0 ? 0 : match_length - QOI_LZ_MIN_MATCH;
+	size_t output_index = 0;
+
+	output[output_index++] = (MIN(literal_length, 15) << 4) | MIN(extra_length, 15);
+	output_index += lz_write_length(output + output_index, literal_length);
+	memcpy(output + output_index, literals, literal_length);
+	output_index += literal_length;
+
+	if (match_length != 0) {
+		output[output_index++] = offset & 0xFF;
+		output[output_index++] = offset >> 8;
+		output_index += lz_write_length(output + output_index, extra_length);
+	}
+
+	return output_index;
 }
 
 /**
- * Returns the error code for the previous failure. A string representation
- * of this code can be acquired via qoi_strerror().
+ * Compresses the bytes of WINDOW from START up to END into OUTPUT. Matches may
+ * refer back into the bytes before START. TABLE holds the last position plus
+ * one at which each hash was seen, and is updated. OUTPUT must have room for
+ * QOI_LZ_BOUND() of the input size. Returns the number of bytes written.
  */
-int qoi_errno()
+static size_t lz_compress(
+		const uint8_t *window,
+		const size_t start,
+		const size_t end,
+		uint32_t *table,
+		uint8_t *output)
 {
-	return qoi_error;
+	size_t output_index = 0;
+	size_t anchor = start;
+	size_t position = start;
+
+	while (position + QOI_LZ_MIN_MATCH <= end) {
+		uint32_t hash = lz_hash(window + position);
+		size_t candidate = table[hash];
+		table[hash] = position + 1;
+
+		if (candidate == 0 ||
+		    position - (candidate - 1) > QOI_LZ_WINDOW ||
+		    memcmp(window + candidate - 1, window + position, QOI_LZ_MIN_MATCH) != 0) {
+
+			/* Step faster through data that does not compress. */
+			position += 1 + ((position - anchor) >> 6);
+			continue;
+		}
+
+		/* Extend the match as far as it goes. */
+		candidate--;
+		size_t length = QOI_LZ_MIN_MATCH;
+		while (position + length < end && window[candidate + length] == window[position + length]) {
+			length++;
+		}
+
+		output_index += lz_write_sequence(
+				output + output_index,
+				window + anchor,
+				position - anchor,
+				position - candidate,
+				length);
+
+		position += length;
+		anchor = position;
+	}
+
+	/* The block always ends with a sequence of literals, even if empty. */
+	output_index += lz_write_sequence(output + output_index, window + anchor, end - anchor, 0, 0);
+
+	return output_index;
 }
 
 /**
- * Returns a string representation of the given error code. The returned string
- * is statically allocated and should NOT be freed.
+ * Decompresses the INPUT_SIZE bytes of INPUT into WINDOW from START, writing
+ * at most CAPACITY bytes. Matches may refer back into the bytes before START.
+ * Returns the number of bytes written, or -1 if INPUT is not valid.
  */
-const char *qoi_strerror(
-		int error_code)
+static ssize_t lz_decompress(
+		const uint8_t *input,
+		const size_t input_size,
+		uint8_t *window,
+		const size_t start,
+		const size_t capacity)
 {
-	if (error_code < 0 || error_code >= QOI_INVALID_ERROR_CODE) {
-		return qoi_strerror_messages[QOI_INVALID_ERROR_CODE];
+	size_t input_index = 0;
+	size_t position = start;
+	size_t end = start + capacity;
+
+	while (input_index < input_size) {
+		uint8_t token = input[input_index++];
+
+		/* Copy the literals. */
+		size_t literal_length = token >> 4;
+		if (literal_length == 15 &&
+		    lz_read_length(input, input_size, &input_index, &literal_length) == -1) {
+
+			return -1;
+		}
+
+		if (literal_length > input_size - input_index || literal_length > end - position) {
+			return -1;
+		}
+
+		memcpy(window + position, input + input_index, literal_length);
+		input_index += literal_length;
+		position += literal_length;
+
+		/* The last sequence has no match. */
+		if (input_index == input_size) {
+			break;
+		}
+
+		/* Copy the match, which may overlap the bytes it produces. */
+		if (input_size - input_index < 2) {
+			return -1;
+		}
+
+		size_t offset = input[input_index] | (input[input_index + 1] << 8);
+		input_index += 2;
+
+		size_t match_length = token & 0x0F;
+		if (match_length == 15 &&
+		    lz_read_length(input, input_size, &input_index, &match_length) == -1) {
+
+			return -1;
+		}
+		match_length += QOI_LZ_MIN_MATCH;
+
+		if (offset == 0 || offset > position || match_length > end - position) {
+			return -1;
+		}
+
+		for (size_t i = 0; i < match_length; i++, position++) {
+			window[position] = window[position - offset];
+		}
 	}
 
-	return qoi_strerror_messages[error_code];
+	return position - start;
 }
 
 /**
- * Returns 1 if the Qoi image has an alpha channel, and 0 if it does not.
+ * Keeps only the last QOI_LZ_WINDOW of the LENGTH bytes in WINDOW, moving them
+ * to its start. If TABLE is not NULL, its positions are moved to match.
+ * Returns the number of bytes kept.
  */
-int qoi_has_alpha(
-		const Qoi *self)
+static size_t slide_window(
+		uint8_t *window,
+		const size_t length,
+		uint32_t *table)
 {
-	return self->channels == QOI_CHANNEL_RGBA;
+	size_t kept = MIN(length, QOI_LZ_WINDOW);
+	size_t shift = length - kept;
+	memmove(window, window + shift, kept);
+
+	if (table != NULL && shift != 0) {
+		for (size_t i = 0; i < QOI_LZ_TABLE_SIZE; i++) {
+			table[i] = table[i] > shift ? table[i] - shift : 0;
+		}
+	}
+
+	return kept;
 }
 
 /**
- * Returns the width (in pixels) of this image.
+ * Returns the offset in the sequence SELF at which the frame at INDEX starts.
+ * The frame count itself gives the offset of the end of the last frame, which
+ * is where the frame offsets start.
  */
-int qoi_get_width(
-		const Qoi *self)
+static uint64_t frame_offset(
+		const QoiSequence *self,
+		const uint32_t index)
 {
-	return self->width;
+	if (index == self->frame_count) {
+		return self->index_start;
+	}
+
+	return big_endian64(self->index + (size_t) index * 8);
 }
 
 /**
- * Returns the height (in pixels) of this image.
+ * Resets HASHER to hash a new series of bytes.
  */
-int qoi_get_height(
-		const Qoi *self)
+static void hasher_init(
+		hasher *self)
 {
-	return self->height;
+	self->lanes[0] = QOI_HASH_PRIME1 + QOI_HASH_PRIME2;
+	self->lanes[1] = QOI_HASH_PRIME2;
+	self->lanes[2] = 0;
+	self->lanes[3] = -QOI_HASH_PRIME1;
+	self->length = 0;
+	self->buffered = 0;
 }
 
 /**
- * Returns the number of bytes between the start of subsequent pixel rows, in
- * the raster. This will always be equal to the width times 3 or 4 (3 if an
- * alpha channel does not exist, and 4 if it does).
+ * Reads the eight bytes at RAW as a little endian 64 bit number.
  */
-int qoi_get_rowstride(
-		const Qoi *self)
+static uint64_t little_endian64(
+		const uint8_t *raw)
 {
-	return self->width * self->channels;
+	return (uint64_t) raw[0] |
+	       ((uint64_t) raw[1] << 8) |
+	       ((uint64_t) raw[2] << 16) |
+	       ((uint64_t) raw[3] << 24) |
+	       ((uint64_t) raw[4] << 32) |
+	       ((uint64_t) raw[5] << 40) |
+	       ((uint64_t) raw[6] << 48) |
+	       ((uint64_t) raw[7] << 56);
 }
 
 /**
- * Converts the given four bytes into a 32 bit number by interpreting the bytes
- * as big endian.
+ * Rotates the bits of VALUE left by COUNT places.
  */
-static uint32_t big_endian(
-		const unsigned char *raw)
+static uint64_t rotate_left(
+		const uint64_t value,
+		const int count)
 {
-	return (raw[0] << 24) | (raw[1] << 16) | (raw[2] << 8)  | raw[3];
+	return (value << count) | (value >> (64 - count));
 }
 
 /**
- * Stores the 32 bit numerical INPUT into a big endian array OUTPUT.
+ * Mixes the eight bytes of INPUT into the hash lane ACCUMULATOR.
  */
-static void big_endian_r(
-		char *output,
-		const uint32_t input)
+static uint64_t hash_round(
+		uint64_t accumulator,
+		const uint64_t input)
 {
-	output[0] = (input & 0xFF000000) >> 24;
-	output[1] = (input & 0xFF0000) >> 16;
-	output[2] = (input & 0xFF00) >> 8;
-	output[3] = input & 0xFF;
+	accumulator += input * QOI_HASH_PRIME2;
+	accumulator = rotate_left(accumulator, 31);
+	return accumulator * QOI_HASH_PRIME1;
 }
 
 /**
- * Retrieves the size in bytes of the file given by the FILEPATH.
+ * Mixes each of the 32 byte stripes in the SIZE bytes of INPUT into the lanes
+ * of HASHER. SIZE must be a multiple of 32.
  */
-static ssize_t filesize(
-		const char *filepath)
+static void hasher_stripes(
+		hasher *self,
+		const uint8_t *input,
+		const size_t size)
 {
-	struct stat meta;
-	if (stat(filepath, &meta) == -1) {
-		return -1;
+	uint64_t lanes[4] = { self->lanes[0], self->lanes[1], self->lanes[2], self->lanes[3] };
+
+	for (size_t i = 0; i < size; i += 32) {
+		lanes[0] = hash_round(lanes[0], little_endian64(input + i));
+		lanes[1] = hash_round(lanes[1], little_endian64(input + i + 8));
+		lanes[2] = hash_round(lanes[2], little_endian64(input + i + 16));
+		lanes[3] = hash_round(lanes[3], little_endian64(input + i + 24));
 	}
 
-	return meta.st_size;
+	memcpy(self->lanes, lanes, sizeof(lanes));
 }
 
 /**
- * Decrypts the raw file data INPUT into a pixel buffer OUTPUT.
+ * Adds the SIZE bytes of INPUT to the bytes hashed by HASHER.
  */
-static int decode(
-		const unsigned char *input,
-		char *output,
-		const size_t output_size,
-		const char has_alpha_channel)
+static void hasher_update(
+		hasher *self,
+		const uint8_t *input,
+		size_t size)
 {
-	int output_index = 0, input_index = 0;
-
-	color last_color = { .r = 0, .g = 0, .b = 0, .a = 255 };
-	color previous_colors[64];
-	memset(previous_colors, 0, sizeof(previous_colors));
-
-	while (output_index < output_size) {
-		uint8_t byte = input[input_index++];
+	self->length += size;
 
-		if (IS_QOI_OP_RGB(byte)) {
-			output[output_index]     = input[input_index++];
-			output[output_index + 1] = input[input_index++];
-			output[output_index + 2] = input[input_index++];
-			if (has_alpha_channel) {
-				output[output_index + 3] = last_color.a;
-			}
-		} else if (IS_QOI_OP_RGBA(byte)) {
-			output[output_index]     = input[input_index++];
-			output[output_index + 1] = input[input_index++];
-			output[output_index + 2] = input[input_index++];
-			if (has_alpha_channel) {
-				output[output_index + 3] = input[input_index++];
-			}
-		} else if (IS_QOI_OP_INDEX(byte)) {
-			int index = byte & 0x3F;
-			last_color = previous_colors[index];
-			output[output_index]     = last_color.r;
-			output[output_index + 1] = last_color.g;
-			output[output_index + 2] = last_color.b;
-			if (has_alpha_channel) {
-				output[output_index + 3] = last_color.a;
-			}
-		} else if (IS_QOI_OP_DIFF(byte)) {
-			uint8_t dr = (byte & 0x30) >> 4;
-			uint8_t dg = (byte & 0x0C) >> 2;
-			uint8_t db = byte & 0x03;
-
-			uint8_t r = last_color.r + (dr - 2);
-			uint8_t g = last_color.g + (dg - 2);
-			uint8_t b = last_color.b + (db - 2);
-
-			output[output_index]     = r;
-			output[output_index + 1] = g;
-			output[output_index + 2] = b;
-			if (has_alpha_channel) {
-				output[output_index + 3] = last_color.a;
-			}
-		} else if (IS_QOI_OP_LUMA(byte)) {
-			int8_t dg = (byte & 0x3F) - 32;
-			int8_t drdg = (input[input_index] & 0xF0) >> 4;
-			int8_t dbdg = input[input_index] & 0x0F;
-			input_index++;
-
-			uint8_t r = last_color.r + dg + (drdg - 8);
-			uint8_t g = last_color.g + dg;
-			uint8_t b = last_color.b + dg + (dbdg - 8);
-
-			output[output_index]     = r;
-			output[output_index + 1] = g;
-			output[output_index + 2] = b;
-			if (has_alpha_channel) {
-				output[output_index + 3] = last_color.a;
-			}
-		} else if (IS_QOI_OP_RUN(byte)) {
-			int8_t run_length = byte & 0x3F;
-			for (int i = 0; i < run_length + 1; i++) {
-				output[output_index++] = last_color.r;
-				output[output_index++] = last_color.g;
-				output[output_index++] = last_color.b;
-				if (has_alpha_channel) {
-					output[output_index++] = last_color.a;
-				}
-			}
-			output_index -= 3 + has_alpha_channel;
-		}
+	/* Complete a partly filled stripe first. */
+	if (self->buffered != 0) {
+		size_t needed = MIN(32 - self->buffered, size);
+		memcpy(self->buffer + self->buffered, input, needed);
+		self->buffered += needed;
+		input += needed;
+		size -= needed;
 
-		last_color.r = output[output_index];
-		last_color.g = output[output_index + 1];
-		last_color.b = output[output_index + 2];
-		if (has_alpha_channel) {
-			last_color.a = output[output_index + 3];
+		if (self->buffered < 32) {
+			return;
 		}
-		output_index += 3 + has_alpha_channel;
 
-		previous_colors[color_hash(last_color)] = last_color;
+		hasher_stripes(self, self->buffer, 32);
+		self->buffered = 0;
 	}
 
-	return 0;
+	size_t whole = size & ~(size_t) 31;
+	hasher_stripes(self, input, whole);
+
+	memcpy(self->buffer, input + whole, size - whole);
+	self->buffered = size - whole;
 }
 
 /**
- * Encodes the pixel data in SELF and writes it into the FILE. The FILE should
- * already be open, and will not be closed by this function. Returns 0 on
- * success and a qoi_error code on failure. This does not write the header nor
- * the trailer.
+ * Returns the hash of all of the bytes given to HASHER.
  */
-static int encode(
-		const Qoi *self,
-		FILE *file)
+static uint64_t hasher_final(
+		const hasher *self)
 {
-	int pixels = self->width * self->height;
-
-	color last_color = { .r=0, .g=0, .b=0, .a=255 };
-	color previous_colors[64];
-	memset(previous_colors, 0, sizeof(previous_colors));
-
-	for (int i = 0; i < pixels; i++) {
-		/* Determine the color of the next pixel to process. */
-		color current_pixel = create_color(
-				self->data + (i * self->channels),
-				self->channels);
+	uint64_t hash;
 
-		/* Determine the differences in colors, used to figure out which
-		 * operation to use to encode the data. */
-		int8_t dr = current_pixel.r - last_color.r;
-		int8_t dg = current_pixel.g - last_color.g;
-		int8_t db = current_pixel.b - last_color.b;
-		int8_t da = current_pixel.a - last_color.a;
+	if (self->length >= 32) {
+		hash = rotate_left(self->lanes[0], 1) +
+		       rotate_left(self->lanes[1], 7) +
+		       rotate_left(self->lanes[2], 12) +
+		       rotate_left(self->lanes[3], 18);
 
-		int8_t drdg = dr - dg;
-		int8_t dbdg = db - dg;
+		for (int i = 0; i < 4; i++) {
+			hash ^= hash_round(0, self->lanes[i]);
+			hash = hash * QOI_HASH_PRIME1 + QOI_HASH_PRIME4;
+		}
+	} else {
+		hash = QOI_HASH_PRIME5;
+	}
 
-		int idx;
+	hash += self->length;
 
-		if (color_equal(last_color, current_pixel)) {
-			/* Case 1: Use a run of the previous color. */
-			int length = 1;
-			while (i + length < pixels &&
-			       color_equal(last_color,
-			                   create_color(self->data + ((i + length) * self->channels),
-			                                self->channels))) {
+	/* Mix in the bytes that did not fill a stripe. */
+	size_t i = 0;
+	for (; i + 8 <= self->buffered; i += 8) {
+		hash ^= hash_round(0, little_endian64(self->buffer + i));
+		hash = rotate_left(hash, 27) * QOI_HASH_PRIME1 + QOI_HASH_PRIME4;
+	}
 
-				++length;
-			}
+	if (i + 4 <= self->buffered) {
+		uint64_t word = self->buffer[i] |
+		                (self->buffer[i + 1] << 8) |
+		                (self->buffer[i + 2] << 16) |
+		                ((uint64_t) self->buffer[i + 3] << 24);
 
-			/* Write a run-length operation. */
-			length = MIN(length - 1, 61);
-			uint8_t write = 0xC0 | length;
-			if (fwrite(&write, 1, 1, file) < 1) {
-				return QOI_ERROR_DISK_SPACE;
-			}
+		hash ^= word * QOI_HASH_PRIME1;
+		hash = rotate_left(hash, 23) * QOI_HASH_PRIME2 + QOI_HASH_PRIME3;
+		i += 4;
+	}
 
-			i += length;
-		} else if (dr >= -2 && dr <= 1 &&
-		           dg >= -2 && dg <= 1 &&
-		           db >= -2 && db <= 1 &&
-		           da == 0) {
+	for (; i < self->buffered; i++) {
+		hash ^= self->buffer[i] * QOI_HASH_PRIME5;
+		hash = rotate_left(hash, 11) * QOI_HASH_PRIME1;
+	}
 
-			/* Case 2: Use a difference of each of red, green, and blue. */
-			uint8_t write = 0x40 | ((dr + 2) << 4) | ((dg + 2) << 2) | (db + 2);
-			if (fwrite(&write, 1, 1, file) < 1) {
-				return QOI_ERROR_DISK_SPACE;
-			}
-		} else if ((idx = index_of(previous_colors, 64, current_pixel)) != -1) {
-			/* Case 3: Use an index in the previous colors array. */
-			if (fwrite(&idx, 1, 1, file) < 1) {
-				return QOI_ERROR_DISK_SPACE;
-			}
-		} else if (dg >= -32 && dg <= 31 &&
-		           drdg >= -8 && drdg <= 7 &&
-				   dbdg >= -8 && dbdg <= 7 &&
-				   da == 0) {
+	/* Spread every input bit across the whole hash. */
+	hash ^= hash >> 33;
+	hash *= QOI_HASH_PRIME2;
+	hash ^= hash >> 29;
+	hash *= QOI_HASH_PRIME3;
+	hash ^= hash >> 32;
 
-			/* Case 4: Use a change in luma. */
-			uint8_t write[2];
-			write[0] = 0x80 | (dg + 32);
-			write[1] = ((drdg + 8) << 4) | (dbdg + 8);
-			if (fwrite(write, 1, 2, file) < 2) {
-				return QOI_ERROR_DISK_SPACE;
-			}
-		} else if (da == 0) {
-			/* Case 5: Completely redefine the red, green, and blue values. */
-			uint8_t write[4];
-			write[0] = 0xFE;
-			write[1] = current_pixel.r;
-			write[2] = current_pixel.g;
-			write[3] = current_pixel.b;
-
-			if (fwrite(write, 1, 4, file) < 4) {
-				return QOI_ERROR_DISK_SPACE;
-			}
-		} else {
-			/* Case 6: Completely redefine r, g, b, and alpha values. */
-			uint8_t write[5];
-			write[0] = 0xFF;
-			write[1] = current_pixel.r;
-			write[2] = current_pixel.g;
-			write[3] = current_pixel.b;
-			write[4] = current_pixel.a;
-
-			if (fwrite(write, 1, 5, file) < 5) {
-				return QOI_ERROR_DISK_SPACE;
-			}
-		}
-		
-		last_color = current_pixel;
-		previous_colors[color_hash(current_pixel)] = current_pixel;
-	}
+	return hash;
+}
 
-	return QOI_ERROR_NONE;
+/**
+ * Takes a copy of the current trace callback into TRACER.
+ */
+static void tracer_init(
+		tracer *self)
+{
+	self->callback = atomic_load(&trace_callback);
+	self->userdata = atomic_load(&trace_userdata);
 }
 
 /**
- * Returns the index in the ARRAY that contains the given VALUE.
+ * Returns the current time in nanoseconds if TRACER has a callback, and 0 if
+ * it does not, so that the clock is only read while tracing.
  */
-static int index_of(
-		const color *array,
-		const size_t arraylen,
-		const color value)
+static uint64_t tracer_clock(
+		const tracer *self)
 {
-	for (int i = 0; i < arraylen; i++) {
-		if (color_equal(array[i], value)) {
-			return i;
-		}
+	if (self->callback == NULL) {
+		return 0;
 	}
 
-	return -1;
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
 }
 
 /**
- * Returns the number of channels present in the image. This is either 3 or 4,
- * depending on if the image has an alpha channel or not.
+ * Passes the NANOSECONDS taken by PHASE, and the BYTES and PIXELS handled by
+ * it, to the callback of TRACER, if it has one.
  */
-int qoi_get_channels(
-		const Qoi *self)
+static void tracer_report(
+		const tracer *self,
+		const QoiPhase phase,
+		const uint64_t nanoseconds,
+		const uint64_t bytes,
+		const uint64_t pixels)
 {
-	return self->channels;
+	if (self->callback != NULL) {
+		self->callback(phase, nanoseconds, bytes, pixels, self->userdata);
+	}
 }
@@ -3,6 +3,10 @@
 
 #include <stdint.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 /**
  * QOI supports two colorspaces:
  *   - sRGB with linear alpha, and
@@ -19,6 +23,72 @@ typedef uint8_t QoiChannel;
 extern const QoiChannel QOI_CHANNEL_RGBA;
 extern const QoiChannel QOI_CHANNEL_RGB;
 
+/**
+ * Selects the content hashes to compute while loading or saving an image.
+ * These may be combined with a bitwise or:
+ *   - QOI_HASH_RASTER hashes the raster, and
+ *   - QOI_HASH_ENCODED hashes the bytes of the .qoi file.
+ */
+typedef uint8_t QoiHashType;
+extern const QoiHashType QOI_HASH_RASTER;
+extern const QoiHashType QOI_HASH_ENCODED;
+
+/**
+ * The phases of loading and saving an image that are timed for the trace
+ * callback set by qoi_set_trace_callback():
+ *   - QOI_PHASE_STAT finds the size of the file,
+ *   - QOI_PHASE_READ reads the file,
+ *   - QOI_PHASE_DECODE decodes the pixels,
+ *   - QOI_PHASE_ENCODE encodes the pixels, and
+ *   - QOI_PHASE_WRITE writes the file.
+ */
+typedef uint8_t QoiPhase;
+extern const QoiPhase QOI_PHASE_STAT;
+extern const QoiPhase QOI_PHASE_READ;
+extern const QoiPhase QOI_PHASE_DECODE;
+extern const QoiPhase QOI_PHASE_ENCODE;
+extern const QoiPhase QOI_PHASE_WRITE;
+
+/**
+ * The properties of an image that are found while saving it with
+ * qoi_save_reduced(), or by qoi_get_properties(). These are combined with a
+ * bitwise or:
+ *   - QOI_PROPERTY_OPAQUE if every alpha value is 255,
+ *   - QOI_PROPERTY_BINARY_ALPHA if every alpha value is 0 or 255, and
+ *   - QOI_PROPERTY_GRAYSCALE if every pixel has equal red, green, and blue.
+ * Images without an alpha channel are opaque.
+ */
+typedef uint8_t QoiProperties;
+extern const QoiProperties QOI_PROPERTY_OPAQUE;
+extern const QoiProperties QOI_PROPERTY_BINARY_ALPHA;
+extern const QoiProperties QOI_PROPERTY_GRAYSCALE;
+
+/**
+ * The error codes given by qoi_errno() and qoi_async_errno(). A string
+ * representation of each can be acquired via qoi_strerror().
+ */
+enum
+{
+	QOI_ERROR_NONE,
+	QOI_ERROR_PERMISSIONS,
+	QOI_ERROR_MEMORY,
+	QOI_ERROR_FILE_CONTENT,
+	QOI_ERROR_NOT_QOI_FILE,
+	QOI_ERROR_DISK_SPACE,
+	QOI_ERROR_OUT_OF_RANGE
+};
+
+/**
+ * Holds the content hashes computed while loading or saving an image. Each is
+ * the 64 bit XXH64 hash, with a seed of 0, of the raster or of the file. A
+ * hash that was not selected is 0.
+ */
+typedef struct
+{
+	uint64_t raster;
+	uint64_t encoded;
+} QoiHash;
+
 /**
  * Contains the main QOI object that can be operated upon.
  */
@@ -59,6 +129,79 @@ Qoi *qoi_new_from_data(
 Qoi *qoi_new_from_file(
 		const char *filepath);
 
+/**
+ * Construct a new QOI object from a QOI file, as qoi_new_from_file() does, but
+ * with CHANNELS channels whatever the channel count of the file. Alpha is
+ * dropped or set to 255 as each pixel is decoded. CHANNELS should be
+ * QOI_CHANNEL_RGB or QOI_CHANNEL_RGBA; any other value keeps the channel count
+ * of the file. If the file is not valid, this returns NULL, and qoi_errno()
+ * can be used to find out why. The returned object should be freed using
+ * qoi_free() when no longer needed.
+ */
+Qoi *qoi_new_from_file_channels(
+		const char *filepath,
+		QoiChannel channels);
+
+/**
+ * Construct a new QOI object from a QOI file, as qoi_new_from_file() does, and
+ * compute the content hashes selected by TYPES into HASH while decoding. The
+ * hashes cost little extra, as each block of the file is hashed just after it
+ * is decoded. If the file is not valid, this returns NULL, and qoi_errno() can
+ * be used to find out why. The returned object should be freed using
+ * qoi_free() when no longer needed.
+ */
+Qoi *qoi_new_from_file_hashed(
+		const char *filepath,
+		QoiHashType types,
+		QoiHash *hash);
+
+/**
+ * Construct a new initially blank QOI object, as qoi_new() does, with its
+ * raster held in a memfd. The descriptor can be got with qoi_get_fd() and
+ * passed to another process, which can then use qoi_new_from_fd() to map the
+ * same raster without copying it. If there is an error, this returns NULL,
+ * and qoi_errno() can be used to find out why. The returned object should be
+ * freed using qoi_free() when no longer needed.
+ */
+Qoi *qoi_new_shared(
+		uint32_t width,
+		uint32_t height,
+		QoiColorspace colorspace,
+		QoiChannel channels);
+
+/**
+ * Construct a new QOI object from a QOI file, as qoi_new_from_file() does,
+ * with its raster held in a memfd as for qoi_new_shared(). The file is mapped
+ * into memory and decoded from there, rather than being read into a buffer
+ * first. If the file is not valid, this returns NULL, and qoi_errno() can be
+ * used to find out why. The returned object should be freed using qoi_free()
+ * when no longer needed.
+ */
+Qoi *qoi_new_from_file_shared(
+		const char *filepath);
+
+/**
+ * Construct a new QOI object whose raster is the shared raster held in the
+ * memfd FD, as given by qoi_get_fd() in this or another process. Changes to
+ * the raster are seen by every object that shares it. FD remains owned by the
+ * caller and may be closed once this returns. FD must be sealed against
+ * shrinking, as the memfds made by this library are, so that the mapping
+ * cannot be cut short by another process. If FD does not hold a shared raster,
+ * this returns NULL, and qoi_errno() can be used to find out why. The returned
+ * object should be freed using qoi_free() when no longer needed.
+ */
+Qoi *qoi_new_from_fd(
+		int fd);
+
+/**
+ * Returns the memfd holding the raster of SELF if it is shared, or -1 if it is
+ * not. The descriptor belongs to SELF and is closed by qoi_free(), so it
+ * should be duplicated if it is to outlive SELF, and it can be passed to
+ * another process over a Unix socket.
+ */
+int qoi_get_fd(
+		const Qoi *self);
+
 /**
  * Releases the resources held by a QOI object. Any buffers held by external
  * resources after this call will be invalid.
@@ -74,6 +217,272 @@ int qoi_save(
 		const Qoi *self,
 		const char *filepath);
 
+/**
+ * Saves a QOI object to a .qoi file, as qoi_save() does, and finds its
+ * properties while encoding it, storing them in PROPERTIES unless it is NULL.
+ * If the image has an alpha channel but is opaque, the file is written with 3
+ * channels instead. The pixels are encoded the same either way, so this needs
+ * no second pass. On success returns 0, otherwise returns -1. qoi_errno() can
+ * be used to find out why a save operation failed.
+ */
+int qoi_save_reduced(
+		const Qoi *self,
+		const char *filepath,
+		QoiProperties *properties);
+
+/**
+ * Saves a QOI object to a .qoi file, as qoi_save() does, and computes the
+ * content hashes selected by TYPES into HASH while encoding. The hashes cost
+ * little extra, as each block of pixels is hashed just after it is encoded. On
+ * success returns 0, otherwise returns -1. qoi_errno() can be used to find out
+ * why a save operation failed.
+ */
+int qoi_save_hashed(
+		const Qoi *self,
+		const char *filepath,
+		QoiHashType types,
+		QoiHash *hash);
+
+/**
+ * Estimates the size in bytes of the .qoi file that qoi_save() would write for
+ * SELF, without encoding the whole image. A run of pixels is measured from
+ * each of several evenly spread parts of the raster, choosing operations as
+ * the encoder does, and the cost per pixel is averaged. If ERROR is not NULL,
+ * a bound on the error of the estimate is stored in it. The bound is
+ * statistical rather than certain: the true size is within that many bytes of
+ * the estimate for about 99 images in 100. Small images are measured in full,
+ * and the bound is then 0.
+ */
+uint64_t qoi_estimate_encoded_size(
+		const Qoi *self,
+		uint64_t *error);
+
+/**
+ * Saves a QOI object to a compressed QOI file. The QOI operations are
+ * compressed in blocks as they are encoded, which makes the file denser for
+ * images with repeated patterns. On success returns 0, otherwise returns -1.
+ * qoi_errno() can be used to find out why a save operation failed.
+ */
+int qoi_save_compressed(
+		const Qoi *self,
+		const char *filepath);
+
+/**
+ * Construct a new QOI object from a compressed QOI file written by
+ * qoi_save_compressed(). The file is decompressed and decoded one block at a
+ * time. If the file is not valid, this returns NULL, and qoi_errno() can be
+ * used to find out why. The returned object should be freed using qoi_free()
+ * when no longer needed.
+ */
+Qoi *qoi_new_from_compressed_file(
+		const char *filepath);
+
+/**
+ * Construct a new QOI object from a chunked QOI file written by
+ * qoi_save_chunked(). The strips of the file are decoded in parallel. If the
+ * file is not valid, this returns NULL, and qoi_errno() can be used to find
+ * out why. The returned object should be freed using qoi_free() when no longer
+ * needed.
+ */
+Qoi *qoi_new_from_chunked_file(
+		const char *filepath);
+
+/**
+ * Construct a new QOI object from the strip at INDEX of a chunked QOI file,
+ * without reading the rest of the file. The object is as wide as the image
+ * and as tall as the strip. If the file is not valid or has no such strip,
+ * this returns NULL, and qoi_errno() can be used to find out why. The returned
+ * object should be freed using qoi_free() when no longer needed.
+ */
+Qoi *qoi_new_from_chunked_file_strip(
+		const char *filepath,
+		uint32_t index);
+
+/**
+ * Saves a QOI object to a chunked QOI file. The image is split into strips of
+ * STRIP_HEIGHT rows, which are encoded independently and in parallel so that
+ * they can later be decoded in parallel or one at a time. If STRIP_HEIGHT is
+ * 0, strips of around 64K pixels are used. On success returns 0, otherwise
+ * returns -1. qoi_errno() can be used to find out why a save operation failed.
+ */
+int qoi_save_chunked(
+		const Qoi *self,
+		const char *filepath,
+		uint32_t strip_height);
+
+/**
+ * Converts the .qoi file at QOI_FILEPATH into a chunked QOI file at
+ * CHUNKED_FILEPATH, using strips of STRIP_HEIGHT rows as qoi_save_chunked()
+ * does. On success returns 0, otherwise returns -1. qoi_errno() can be used to
+ * find out why the conversion failed.
+ */
+int qoi_convert_to_chunked(
+		const char *qoi_filepath,
+		const char *chunked_filepath,
+		uint32_t strip_height);
+
+/**
+ * Converts the chunked QOI file at CHUNKED_FILEPATH into a .qoi file at
+ * QOI_FILEPATH. On success returns 0, otherwise returns -1. qoi_errno() can be
+ * used to find out why the conversion failed.
+ */
+int qoi_convert_from_chunked(
+		const char *chunked_filepath,
+		const char *qoi_filepath);
+
+/**
+ * Contains a sequence file of many QOI frames, mapped into memory.
+ */
+typedef struct QoiSequence QoiSequence;
+
+/**
+ * Appends a QOI object as a new frame at the end of a sequence file, creating
+ * the file if it does not exist. The frames already in the file are not
+ * rewritten; only the frame offsets that follow them are. If the frame cannot
+ * be appended, the file is put back as it was, or removed if this created it.
+ * On success returns 0, otherwise returns -1. qoi_errno() can be used to find
+ * out why the frame could not be appended, and is QOI_ERROR_FILE_CONTENT if
+ * the file could not be put back either.
+ */
+int qoi_sequence_append(
+		const Qoi *frame,
+		const char *filepath);
+
+/**
+ * Opens a sequence file by mapping it into memory. Frames are only read from
+ * the file when they are decoded. Frames may be appended to the file with
+ * qoi_sequence_append() while it is open; the sequence keeps the frames it was
+ * opened with, and must be opened again to see the new ones. The file must not
+ * be changed in any other way while it is open. If the file is not valid, this
+ * returns NULL, and qoi_errno() can be used to find out why. The returned
+ * sequence should be freed using qoi_sequence_free() when no longer needed.
+ */
+QoiSequence *qoi_sequence_open(
+		const char *filepath);
+
+/**
+ * Returns the number of frames in the sequence.
+ */
+uint32_t qoi_sequence_get_frame_count(
+		const QoiSequence *self);
+
+/**
+ * Sets the number of frames after each decoded frame that are read ahead from
+ * the file in the background, for smooth playback. A FRAMES of 0, the default,
+ * turns reading ahead off.
+ */
+void qoi_sequence_set_prefetch(
+		QoiSequence *self,
+		uint32_t frames);
+
+/**
+ * Construct a new QOI object by decoding the frame at INDEX of the sequence,
+ * straight from the mapped file. If the frame is not valid or does not exist,
+ * this returns NULL, and qoi_errno() can be used to find out why. The returned
+ * object should be freed using qoi_free() when no longer needed.
+ */
+Qoi *qoi_sequence_get_frame(
+		const QoiSequence *self,
+		uint32_t index);
+
+/**
+ * Unmaps the sequence file and releases the resources held by the sequence.
+ * Objects decoded from it remain valid.
+ */
+void qoi_sequence_free(
+		QoiSequence *self);
+
+/**
+ * Represents a load or save operation that runs in the background.
+ */
+typedef struct QoiAsync QoiAsync;
+
+/**
+ * Begins loading a QOI object from a QOI file in the background, and returns
+ * immediately. The file is read by one of a fixed number of I/O threads, and
+ * is then decoded by one of a thread per processor, so that other reads stay
+ * in flight while it decodes. When the load finishes, CALLBACK (which may be
+ * NULL) is called from a background thread with the operation and USERDATA;
+ * it should return promptly, and must not wait on other operations. The
+ * loaded object is retrieved with qoi_async_get_result(). If the operation
+ * could not be started, this returns NULL, and qoi_errno() can be used to find
+ * out why. The returned operation should be freed using qoi_async_free().
+ */
+QoiAsync *qoi_new_from_file_async(
+		const char *filepath,
+		void (*callback)(QoiAsync*, void*),
+		void *userdata);
+
+/**
+ * Begins saving a QOI object to a .qoi file in the background, and returns
+ * immediately. The image is encoded into memory by one of a thread per
+ * processor, and then written by one of the I/O threads. SELF must not be
+ * freed or changed until the operation has finished. CALLBACK, USERDATA, and
+ * the return value behave as they do for qoi_new_from_file_async().
+ */
+QoiAsync *qoi_save_async(
+		const Qoi *self,
+		const char *filepath,
+		void (*callback)(QoiAsync*, void*),
+		void *userdata);
+
+/**
+ * Returns a file descriptor that becomes readable once the operation has
+ * finished, so that it can be waited upon with poll() or an event loop. The
+ * descriptor belongs to the operation and should not be closed or read.
+ */
+int qoi_async_get_fd(
+		const QoiAsync *op);
+
+/**
+ * Returns 1 if the operation has finished, and 0 if it is still running.
+ */
+int qoi_async_is_done(
+		const QoiAsync *op);
+
+/**
+ * Blocks until the operation has finished. On success returns 0, otherwise
+ * returns -1, and qoi_async_errno() can be used to find out why. This must not
+ * be called from the operation's own callback.
+ */
+int qoi_async_wait(
+		QoiAsync *op);
+
+/**
+ * Returns the error code of a finished operation, which is QOI_ERROR_NONE (0)
+ * if it succeeded.
+ */
+int qoi_async_errno(
+		const QoiAsync *op);
+
+/**
+ * Returns the object loaded by a finished qoi_new_from_file_async(), or NULL
+ * if the load failed or the operation was a save. The object belongs to the
+ * caller, and should be freed using qoi_free() when no longer needed.
+ */
+Qoi *qoi_async_get_result(
+		const QoiAsync *op);
+
+/**
+ * Waits for the operation to finish and releases the resources held by it.
+ * This must not be called from the operation's own callback.
+ */
+void qoi_async_free(
+		QoiAsync *op);
+
+/**
+ * Sets a function to be called with the time taken by each phase of every
+ * load and save, in nanoseconds, and the number of bytes and pixels handled
+ * by it. Each phase is reported once, with its total time, even when it is
+ * done a block at a time.
+ * CALLBACK is called from the thread doing the load or save, with USERDATA.
+ * Passing NULL removes the callback, after which nothing is timed. This should
+ * be called before any loads or saves are started on other threads.
+ */
+void qoi_set_trace_callback(
+		void (*callback)(QoiPhase, uint64_t, uint64_t, uint64_t, void*),
+		void *userdata);
+
 /**
  * Gets the image buffer. Each pixel is represented with either 24 or 32 bits,
  * depending on if the Qoi object is set to QOI_CHANNEL_RGB or QOI_CHANNEL_RGBA
@@ -95,8 +504,8 @@ uint8_t *qoi_get_raster_clone(
 		const Qoi *self);
 
 /**
- * Returns the error code for the previous failure. A string representation
- * of this code can be acquired via qoi_strerror().
+ * Returns the error code for the previous failure on the calling thread. A
+ * string representation of this code can be acquired via qoi_strerror().
  */
 int qoi_errno();
 
@@ -107,6 +516,12 @@ int qoi_errno();
 const char *qoi_strerror(
 		int error_code);
 
+/**
+ * Returns the properties of the Qoi image, found by scanning its raster.
+ */
+QoiProperties qoi_get_properties(
+		const Qoi *self);
+
 /**
  * Returns 1 if the Qoi image has an alpha channel, and 0 if it does not.
  */
@@ -140,4 +555,8 @@ int qoi_get_rowstride(
 int qoi_get_channels(
 		const Qoi *self);
 
+#ifdef __cplusplus
+}
+#endif
+
 #endif /* QOI_H */
@@ -0,0 +1,608 @@
+#ifndef QOI_HPP
+#define QOI_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <span>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+#include "qoi.h"
+
+/**
+ * A header-only C++20 interface to libqoi. Image owns a Qoi object, and the
+ * encode() and decode() templates work directly on borrowed buffers. The
+ * encoder and decoder are templated on the pixel layout, so that the channel
+ * count and order are known at compile time.
+ */
+namespace qoi
+{
+
+/**
+ * The pixel layouts that encode() and decode() can work with. Each gives the
+ * number of bytes per pixel, and the offset of each channel within a pixel.
+ * Layouts without an alpha channel are treated as fully opaque.
+ */
+struct Rgb
+{
+	static constexpr std::size_t channels = 3;
+	static constexpr std::size_t r = 0, g = 1, b = 2, a = 0;
+	static constexpr bool has_alpha = false;
+};
+
+struct Rgba
+{
+	static constexpr std::size_t channels = 4;
+	static constexpr std::size_t r = 0, g = 1, b = 2, a = 3;
+	static constexpr bool has_alpha = true;
+};
+
+struct Bgr
+{
+	static constexpr std::size_t channels = 3;
+	static constexpr std::size_t r = 2, g = 1, b = 0, a = 0;
+	static constexpr bool has_alpha = false;
+};
+
+struct Bgra
+{
+	static constexpr std::size_t channels = 4;
+	static constexpr std::size_t r = 2, g = 1, b = 0, a = 3;
+	static constexpr bool has_alpha = true;
+};
+
+/**
+ * The channel counts and colorspaces that an image can have, as given by the
+ * QOI_CHANNEL_ and QOI_COLORSPACE_ constants in C. They are distinct types, so
+ * that one cannot be passed in place of the other.
+ */
+enum class Channels : std::uint8_t
+{
+	rgb = 3,
+	rgba = 4
+};
+
+enum class Colorspace : std::uint8_t
+{
+	srgb = 0,
+	linear = 1
+};
+
+/**
+ * Thrown when an operation fails. code() gives the libqoi error code, which is
+ * the same as would be returned by qoi_errno().
+ */
+class Error : public std::runtime_error
+{
+public:
+	explicit Error(int code)
+		: std::runtime_error(qoi_strerror(code)), error_code(code)
+	{
+	}
+
+	int code() const noexcept
+	{
+		return error_code;
+	}
+
+private:
+	int error_code;
+};
+
+/**
+ * The fields of a QOI file header.
+ */
+struct Header
+{
+	std::uint32_t width;
+	std::uint32_t height;
+	std::uint8_t channels;
+	std::uint8_t colorspace;
+};
+
+/**
+ * Owns a Qoi object, and frees it using qoi_free() when destroyed. Images can
+ * be moved but not copied.
+ */
+class Image
+{
+public:
+	/**
+	 * Creates a new blank image, as qoi_new() does, taking its arguments in
+	 * the same order.
+	 */
+	Image(std::uint32_t width,
+	      std::uint32_t height,
+	      Colorspace colorspace,
+	      Channels channels)
+		: handle(qoi_new(width,
+		                 height,
+		                 static_cast<QoiColorspace>(colorspace),
+		                 static_cast<QoiChannel>(channels)))
+	{
+		if (handle == nullptr) {
+			throw Error(qoi_errno());
+		}
+	}
+
+	/**
+	 * Takes ownership of a Qoi object created through the C interface.
+	 */
+	explicit Image(Qoi *handle) noexcept
+		: handle(handle)
+	{
+	}
+
+	Image(Image &&other) noexcept
+		: handle(std::exchange(other.handle, nullptr))
+	{
+	}
+
+	Image &operator=(Image &&other) noexcept
+	{
+		if (this != &other) {
+			reset();
+			handle = std::exchange(other.handle, nullptr);
+		}
+
+		return *this;
+	}
+
+	Image(const Image&) = delete;
+	Image &operator=(const Image&) = delete;
+
+	~Image()
+	{
+		reset();
+	}
+
+	/**
+	 * Loads an image from a .qoi file, as qoi_new_from_file() does.
+	 */
+	static Image load(const char *filepath)
+	{
+		Qoi *handle = qoi_new_from_file(filepath);
+		if (handle == nullptr) {
+			throw Error(qoi_errno());
+		}
+
+		return Image(handle);
+	}
+
+	/**
+	 * Saves the image to a .qoi file, as qoi_save() does.
+	 */
+	void save(const char *filepath) const
+	{
+		if (qoi_save(handle, filepath) == -1) {
+			throw Error(qoi_errno());
+		}
+	}
+
+	/**
+	 * Gets the raster of the image. Changing it changes the image.
+	 */
+	std::span<std::uint8_t> raster() noexcept
+	{
+		return { qoi_get_raster(handle), size() };
+	}
+
+	std::span<const std::uint8_t> raster() const noexcept
+	{
+		return { qoi_get_raster(handle), size() };
+	}
+
+	std::uint32_t width() const noexcept
+	{
+		return qoi_get_width(handle);
+	}
+
+	std::uint32_t height() const noexcept
+	{
+		return qoi_get_height(handle);
+	}
+
+	std::uint8_t channels() const noexcept
+	{
+		return qoi_get_channels(handle);
+	}
+
+	bool has_alpha() const noexcept
+	{
+		return qoi_has_alpha(handle);
+	}
+
+	/**
+	 * Gets the Qoi object, which remains owned by this image.
+	 */
+	Qoi *get() const noexcept
+	{
+		return handle;
+	}
+
+	/**
+	 * Gives up ownership of the Qoi object, which must then be freed using
+	 * qoi_free() when no longer needed.
+	 */
+	Qoi *release() noexcept
+	{
+		return std::exchange(handle, nullptr);
+	}
+
+private:
+	std::size_t size() const noexcept
+	{
+		return static_cast<std::size_t>(width()) * height() * channels();
+	}
+
+	void reset() noexcept
+	{
+		if (handle != nullptr) {
+			qoi_free(handle);
+			handle = nullptr;
+		}
+	}
+
+	Qoi *handle;
+};
+
+namespace detail
+{
+
+constexpr std::size_t header_size = 14;
+constexpr std::size_t trailer_size = 8;
+
+/**
+ * Returns the number of pixels in an image of the given dimensions. Throws
+ * Error(QOI_ERROR_MEMORY) if the image could not be held in memory, laid out
+ * as given by Layout or encoded, so that no buffer size computed from the
+ * dimensions can overflow. libqoi refuses such images in the same way.
+ */
+template <class Layout>
+constexpr std::size_t checked_pixel_count(std::uint32_t width, std::uint32_t height)
+{
+	std::size_t pixel_count = static_cast<std::size_t>(width) * height;
+	if ((height != 0 && pixel_count / height != width) ||
+	    pixel_count > (SIZE_MAX - header_size - trailer_size) / (Layout::channels + 1)) {
+
+		throw Error(QOI_ERROR_MEMORY);
+	}
+
+	return pixel_count;
+}
+
+struct Color
+{
+	std::uint8_t r, g, b, a;
+
+	bool operator==(const Color&) const = default;
+};
+
+/**
+ * Determines the QOI hash of the color, used for indexing into the 'previous
+ * colors' array.
+ */
+inline int hash(const Color c) noexcept
+{
+	return (c.r * 3 + c.g * 5 + c.b * 7 + c.a * 11) % 64;
+}
+
+/**
+ * Reads the pixel at INPUT, which is laid out as given by Layout.
+ */
+template <class Layout>
+inline Color read_pixel(const std::uint8_t *input) noexcept
+{
+	if constexpr (Layout::has_alpha) {
+		return { input[Layout::r], input[Layout::g], input[Layout::b], input[Layout::a] };
+	} else {
+		return { input[Layout::r], input[Layout::g], input[Layout::b], 255 };
+	}
+}
+
+/**
+ * Writes the color C to the pixel at OUTPUT, which is laid out as given by
+ * Layout.
+ */
+template <class Layout>
+inline void write_pixel(std::uint8_t *output, const Color c) noexcept
+{
+	output[Layout::r] = c.r;
+	output[Layout::g] = c.g;
+	output[Layout::b] = c.b;
+	if constexpr (Layout::has_alpha) {
+		output[Layout::a] = c.a;
+	}
+}
+
+inline void write_big_endian(std::uint8_t *output, std::uint32_t value) noexcept
+{
+	output[0] = value >> 24;
+	output[1] = value >> 16;
+	output[2] = value >> 8;
+	output[3] = value;
+}
+
+inline std::uint32_t read_big_endian(const std::uint8_t *input) noexcept
+{
+	return (static_cast<std::uint32_t>(input[0]) << 24) |
+	       (input[1] << 16) |
+	       (input[2] << 8) |
+	       input[3];
+}
+
+/**
+ * Encodes PIXEL_COUNT pixels from INPUT into QOI operations in OUTPUT, making
+ * the same choices of operation as the C encoder. Returns the number of bytes
+ * written.
+ */
+template <class Layout>
+std::size_t encode_pixels(
+		const std::uint8_t *input,
+		const std::size_t pixel_count,
+		std::uint8_t *output) noexcept
+{
+	std::size_t output_index = 0;
+	Color last_color = { 0, 0, 0, 255 };
+	Color previous_colors[64] = {};
+
+	for (std::size_t i = 0; i < pixel_count; i++) {
+		Color current_pixel = read_pixel<Layout>(input + i * Layout::channels);
+
+		std::int8_t dr = current_pixel.r - last_color.r;
+		std::int8_t dg = current_pixel.g - last_color.g;
+		std::int8_t db = current_pixel.b - last_color.b;
+		std::int8_t da = current_pixel.a - last_color.a;
+
+		std::int8_t drdg = dr - dg;
+		std::int8_t dbdg = db - dg;
+
+		int index = hash(current_pixel);
+
+		if (current_pixel == last_color) {
+			/* Case 1: Use a run of the previous color. */
+			std::size_t length = 1;
+			while (i + length < pixel_count && length < 62 &&
+			       read_pixel<Layout>(input + (i + length) * Layout::channels) == last_color) {
+
+				++length;
+			}
+
+			output[output_index++] = 0xC0 | (length - 1);
+			i += length - 1;
+		} else if (dr >= -2 && dr <= 1 &&
+		           dg >= -2 && dg <= 1 &&
+		           db >= -2 && db <= 1 &&
+		           da == 0) {
+
+			/* Case 2: Use a difference of each of red, green, and blue. */
+			output[output_index++] =
+				0x40 | ((dr + 2) << 4) | ((dg + 2) << 2) | (db + 2);
+		} else if (previous_colors[index] == current_pixel) {
+			/* Case 3: Use an index in the previous colors array. */
+			output[output_index++] = index;
+		} else if (dg >= -32 && dg <= 31 &&
+		           drdg >= -8 && drdg <= 7 &&
+		           dbdg >= -8 && dbdg <= 7 &&
+		           da == 0) {
+
+			/* Case 4: Use a change in luma. */
+			output[output_index++] = 0x80 | (dg + 32);
+			output[output_index++] = ((drdg + 8) << 4) | (dbdg + 8);
+		} else if (da == 0) {
+			/* Case 5: Completely redefine the red, green, and blue values. */
+			output[output_index++] = 0xFE;
+			output[output_index++] = current_pixel.r;
+			output[output_index++] = current_pixel.g;
+			output[output_index++] = current_pixel.b;
+		} else {
+			/* Case 6: Completely redefine r, g, b, and alpha values. */
+			output[output_index++] = 0xFF;
+			output[output_index++] = current_pixel.r;
+			output[output_index++] = current_pixel.g;
+			output[output_index++] = current_pixel.b;
+			output[output_index++] = current_pixel.a;
+		}
+
+		last_color = current_pixel;
+		previous_colors[index] = current_pixel;
+	}
+
+	return output_index;
+}
+
+/**
+ * Decodes PIXEL_COUNT pixels from the INPUT_SIZE bytes of QOI operations in
+ * INPUT into OUTPUT. Returns false if INPUT ends too early.
+ */
+template <class Layout>
+bool decode_pixels(
+		const std::uint8_t *input,
+		const std::size_t input_size,
+		std::uint8_t *output,
+		const std::size_t pixel_count) noexcept
+{
+	std::size_t input_index = 0;
+	Color last_color = { 0, 0, 0, 255 };
+	Color previous_colors[64] = {};
+	int run = 0;
+
+	for (std::size_t i = 0; i < pixel_count; i++) {
+		if (run > 0) {
+			run--;
+		} else {
+			if (input_index >= input_size) {
+				return false;
+			}
+
+			std::uint8_t byte = input[input_index++];
+
+			if (byte == 0xFE) {
+				if (input_size - input_index < 3) {
+					return false;
+				}
+
+				last_color.r = input[input_index++];
+				last_color.g = input[input_index++];
+				last_color.b = input[input_index++];
+			} else if (byte == 0xFF) {
+				if (input_size - input_index < 4) {
+					return false;
+				}
+
+				last_color.r = input[input_index++];
+				last_color.g = input[input_index++];
+				last_color.b = input[input_index++];
+				last_color.a = input[input_index++];
+			} else if ((byte & 0xC0) == 0x00) {
+				last_color = previous_colors[byte];
+			} else if ((byte & 0xC0) == 0x40) {
+				last_color.r += ((byte >> 4) & 0x03) - 2;
+				last_color.g += ((byte >> 2) & 0x03) - 2;
+				last_color.b += (byte & 0x03) - 2;
+			} else if ((byte & 0xC0) == 0x80) {
+				if (input_index >= input_size) {
+					return false;
+				}
+
+				int dg = (byte & 0x3F) - 32;
+				std::uint8_t next = input[input_index++];
+				last_color.r += dg + (next >> 4) - 8;
+				last_color.g += dg;
+				last_color.b += dg + (next & 0x0F) - 8;
+			} else {
+				run = byte & 0x3F;
+			}
+
+			previous_colors[hash(last_color)] = last_color;
+		}
+
+		write_pixel<Layout>(output + i * Layout::channels, last_color);
+	}
+
+	return true;
+}
+
+} /* namespace detail */
+
+/**
+ * Returns the largest size that an image of the given dimensions can be
+ * encoded into by encode_into(). Throws Error(QOI_ERROR_MEMORY) if the image
+ * is too large to be held in memory.
+ */
+template <class Layout>
+constexpr std::size_t max_encoded_size(std::uint32_t width, std::uint32_t height)
+{
+	return detail::header_size +
+	       detail::checked_pixel_count<Layout>(width, height) * (Layout::channels + 1) +
+	       detail::trailer_size;
+}
+
+/**
+ * Encodes the image in PIXELS, laid out as given by Layout, into a complete
+ * .qoi file in OUTPUT. OUTPUT must hold at least max_encoded_size() bytes.
+ * Returns the number of bytes written. The file has 4 channels if Layout has
+ * an alpha channel, and 3 otherwise.
+ */
+template <class Layout>
+std::size_t encode_into(
+		std::span<const std::uint8_t> pixels,
+		std::uint32_t width,
+		std::uint32_t height,
+		std::span<std::uint8_t> output,
+		Colorspace colorspace = Colorspace::srgb)
+{
+	std::size_t pixel_count = detail::checked_pixel_count<Layout>(width, height);
+	if (pixels.size() < pixel_count * Layout::channels) {
+		throw std::invalid_argument("qoi::encode_into: pixel buffer is too small");
+	}
+
+	if (output.size() < max_encoded_size<Layout>(width, height)) {
+		throw std::invalid_argument("qoi::encode_into: output buffer is too small");
+	}
+
+	std::uint8_t *out = output.data();
+	std::memcpy(out, "qoif", 4);
+	detail::write_big_endian(out + 4, width);
+	detail::write_big_endian(out + 8, height);
+	out[12] = Layout::has_alpha ? 4 : 3;
+	out[13] = static_cast<std::uint8_t>(colorspace);
+
+	std::size_t size = detail::header_size;
+	size += detail::encode_pixels<Layout>(pixels.data(), pixel_count, out + size);
+
+	static constexpr std::uint8_t trailer[detail::trailer_size] = { 0, 0, 0, 0, 0, 0, 0, 1 };
+	std::memcpy(out + size, trailer, detail::trailer_size);
+
+	return size + detail::trailer_size;
+}
+
+/**
+ * Encodes the image in PIXELS, laid out as given by Layout, into a complete
+ * .qoi file, as encode_into() does.
+ */
+template <class Layout>
+std::vector<std::uint8_t> encode(
+		std::span<const std::uint8_t> pixels,
+		std::uint32_t width,
+		std::uint32_t height,
+		Colorspace colorspace = Colorspace::srgb)
+{
+	std::vector<std::uint8_t> output(max_encoded_size<Layout>(width, height));
+	output.resize(encode_into<Layout>(pixels, width, height, output, colorspace));
+	return output;
+}
+
+/**
+ * Reads the header of the .qoi file in FILE, without decoding it.
+ */
+inline Header read_header(std::span<const std::uint8_t> file)
+{
+	if (file.size() < detail::header_size ||
+	    std::memcmp(file.data(), "qoif", 4) != 0 ||
+	    (file[12] != 3 && file[12] != 4)) {
+
+		throw Error(QOI_ERROR_NOT_QOI_FILE);
+	}
+
+	return {
+		detail::read_big_endian(file.data() + 4),
+		detail::read_big_endian(file.data() + 8),
+		file[12],
+		file[13]
+	};
+}
+
+/**
+ * Decodes the .qoi file in FILE into PIXELS, laid out as given by Layout,
+ * whatever the channel count of the file. PIXELS must hold the width times
+ * height times Layout::channels bytes given by the header. Returns the header.
+ * Throws Error(QOI_ERROR_MEMORY) if the header gives an image too large to be
+ * held in memory.
+ */
+template <class Layout>
+Header decode(
+		std::span<const std::uint8_t> file,
+		std::span<std::uint8_t> pixels)
+{
+	Header header = read_header(file);
+	std::size_t pixel_count = detail::checked_pixel_count<Layout>(header.width, header.height);
+	if (pixels.size() < pixel_count * Layout::channels) {
+		throw std::invalid_argument("qoi::decode: pixel buffer is too small");
+	}
+
+	if (!detail::decode_pixels<Layout>(file.data() + detail::header_size,
+	                                   file.size() - detail::header_size,
+	                                   pixels.data(),
+	                                   pixel_count)) {
+
+		throw Error(QOI_ERROR_FILE_CONTENT);
+	}
+
+	return header;
+}
+
+} /* namespace qoi */
+
+#endif /* QOI_HPP */